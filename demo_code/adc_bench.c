@@ -0,0 +1,130 @@
+/*
+ *  adc_bench.c
+ *
+ *  userland benchmark that hammers an adc device from several
+ *  processes at once and reports how many context switches each
+ *  completed read() cost. Run it against the module before and after
+ *  a change to the driver's wakeup path to compare. Given N, each
+ *  read() becomes one ADC_IOC_READ_N of N samples instead.
+ *
+ *  Copyright (C) 2010  Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "teensy_adc.h"
+
+#define DEBUG(x...) /* fprintf(stderr, x) */
+
+void usage(char * argv0) {
+  fprintf(stderr, "usage: %s ADC_FILE PROCS READS [N]\n\n"
+          "where ADC_FILE is the device to read, e.g. /dev/adc0,\n"
+          "PROCS is the number of concurrent reader processes,\n"
+          "READS is the number of read()s each process makes,\n"
+          "N, if given, makes each read an ADC_IOC_READ_N of N samples.\n",
+          argv0);
+  exit(2);
+}
+
+/* one reader process: open, read @reads samples, or blocks of @n
+ * samples if @n, exit with the number of failed reads (capped) */
+int reader(char * adc_file, int reads, int n) {
+        int fd, i, failed = 0;
+        uint8_t buf[2 * ADC_READ_N_MAX];
+        struct adc_read_n rn = { .count = n, .period_us = ADC_STREAM_TICK_US,
+                                 .buf = (uintptr_t)buf };
+
+        fd = open(adc_file, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "open(%s): ", adc_file);
+                perror(NULL);
+                return 255;
+        }
+        for (i = 0; i < reads; ++i) {
+                if (n ? ioctl(fd, ADC_IOC_READ_N, &rn) < 0
+                      : read(fd, buf, 2) != 2)
+                        failed++;
+                DEBUG("pid %d: %02x%02x\n", getpid(), buf[0], buf[1]);
+        }
+        close(fd);
+        return failed > 254 ? 254 : failed;
+}
+
+int main(int argc, char ** argv) {
+        int procs, reads, n = 0, i, status, failed = 0;
+        long completed, csw;
+        pid_t pid;
+        struct rusage ru;
+        struct timeval start, end;
+        double secs;
+
+        /* check args */
+        if ((argc != 4 && argc != 5) ||
+            sscanf(argv[2], "%i", &procs) != 1 || procs < 1 ||
+            sscanf(argv[3], "%i", &reads) != 1 || reads < 1 ||
+            (argc == 5 && (sscanf(argv[4], "%i", &n) != 1 || n < 1 ||
+                           n > ADC_READ_N_MAX)))
+                usage(argv[0]);
+
+        gettimeofday(&start, NULL);
+        for (i = 0; i < procs; ++i) {
+                pid = fork();
+                if (pid < 0) {
+                        perror("fork");
+                        exit(errno);
+                }
+                if (pid == 0)
+                        exit(reader(argv[1], reads, n));
+        }
+        while ((pid = wait(&status)) > 0)
+                if (WIFEXITED(status))
+                        failed += WEXITSTATUS(status);
+        gettimeofday(&end, NULL);
+
+        /* rusage of all reaped children: every reader's voluntary
+         * switches include the times it was woken for somebody
+         * else's reply and went straight back to sleep */
+        if (getrusage(RUSAGE_CHILDREN, &ru) < 0) {
+                perror("getrusage");
+                exit(errno);
+        }
+
+        completed = (long)procs * reads - failed;
+        csw = ru.ru_nvcsw + ru.ru_nivcsw;
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+        printf("procs=%d reads/proc=%d samples/read=%d completed=%ld failed=%d\n",
+               procs, reads, n ? n : 1, completed, failed);
+        printf("voluntary csw=%ld involuntary csw=%ld\n",
+               ru.ru_nvcsw, ru.ru_nivcsw);
+        if (completed > 0)
+                printf("csw/request=%.2f requests/sec=%.1f\n",
+                       (double)csw / completed, completed / secs);
+        return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ *  adc_capture.c
+ *
+ *  userland demo of the burst capture: arms the teensy on one adc
+ *  unit, waits for the capture to come in and prints it, one
+ *  "microseconds value" line per sample, with the trigger at 0.
+ *
+ *  Copyright (C) 2010  Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "teensy_adc.h"
+
+void usage(char * argv0) {
+  fprintf(stderr, "usage: %s UNIT [TRIGGER LEVEL PRE]\n\n"
+          "where UNIT is the adc unit to capture, e.g. 0 for /dev/adc0,\n"
+          "TRIGGER is now, rising, falling, above or below (default now),\n"
+          "LEVEL is the 8 bit threshold to trigger on,\n"
+          "PRE is how many samples to keep from before the trigger.\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char ** argv) {
+        static const char * triggers[] = { "now", "rising", "falling", "above", "below" };
+        int unit, level = 0, pre = 0, fd, i, n, got = 0;
+        char adc_file[] = "/dev/adc?";
+        uint8_t buf[ADC_CAPTURE_SAMPLES];
+        struct adc_capture cfg;
+
+        /* check args */
+        memset(&cfg, 0, sizeof(cfg));
+        if ((argc != 2 && argc != 5) ||
+            sscanf(argv[1], "%i", &unit) != 1 || unit < 0 || unit > 9)
+                usage(argv[0]);
+        if (argc == 5) {
+                for (i = 0; i < 5 && strcmp(argv[2], triggers[i]); ++i)
+                        ;
+                if (i == 5 ||
+                    sscanf(argv[3], "%i", &level) != 1 || level < 0 || level > 255 ||
+                    sscanf(argv[4], "%i", &pre) != 1 || pre < 0 ||
+                    pre >= ADC_CAPTURE_SAMPLES)
+                        usage(argv[0]);
+                cfg.trigger = i;
+                cfg.level = level;
+                cfg.pre = pre;
+        }
+
+        adc_file[8] = '0' + unit;
+        fd = open(adc_file, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "open(%s): ", adc_file);
+                perror(NULL);
+                exit(errno);
+        }
+
+        if (ioctl(fd, ADC_IOC_CAPTURE, &cfg) < 0) {
+                perror("ioctl(ADC_IOC_CAPTURE)");
+                exit(errno);
+        }
+
+        /* blocks until the trigger, and the rest of the capture, are in */
+        while (got < ADC_CAPTURE_SAMPLES) {
+                n = read(fd, buf + got, sizeof(buf) - got);
+                if (n <= 0) {
+                        perror("read");
+                        exit(errno ? errno : 1);
+                }
+                got += n;
+        }
+        close(fd);
+
+        for (i = 0; i < got; ++i)
+                printf("%ld %d\n",
+                       (long)(i - pre) * ADC_CAPTURE_PERIOD_NS / 1000, buf[i]);
+        return 0;
+}
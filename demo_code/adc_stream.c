@@ -0,0 +1,166 @@
+/*
+ *  adc_stream.c
+ *
+ *  userland demo of adc streaming: starts the teensy scanning one adc
+ *  unit at a fixed period, drains the samples in big read()s, or
+ *  straight from the mmap()ed ring, and reports how many came in and
+ *  how fast.
+ *
+ *  Copyright (C) 2010  Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "teensy_adc.h"
+
+#define DEBUG(x...) /* fprintf(stderr, x) */
+
+void usage(char * argv0) {
+  fprintf(stderr, "usage: %s UNIT PERIOD_US SAMPLES [mmap]\n\n"
+          "where UNIT is the adc unit to stream, e.g. 0 for /dev/adc0,\n"
+          "PERIOD_US is the time between samples in microseconds,\n"
+          "SAMPLES is how many samples to collect,\n"
+          "mmap consumes the ring in place instead of read()ing it.\n",
+          argv0);
+  exit(2);
+}
+
+/* consume @samples samples straight from the mapped ring of @fd;
+ * @return: how many we got, and the last one in *@last */
+int consume_mmap(int fd, int samples, int * last) {
+        volatile struct adc_ring_header * hdr;
+        uint8_t * data, * p;
+        uint32_t head, tail;
+        long size, page = sysconf(_SC_PAGESIZE);
+        int got = 0;
+
+        /* map the header page to learn the size of the whole ring,
+         * then map all of it */
+        hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+        if (hdr == MAP_FAILED) {
+                perror("mmap");
+                exit(errno);
+        }
+        size = hdr->data_offset + hdr->size * hdr->sample_size;
+        size = (size + page - 1) / page * page;
+        munmap((void *)hdr, page);
+
+        hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (hdr == MAP_FAILED) {
+                perror("mmap");
+                exit(errno);
+        }
+        data = (uint8_t *)hdr + hdr->data_offset;
+
+        while (got < samples) {
+                head = hdr->head;
+                __sync_synchronize(); /* read barrier: head before samples */
+                for (tail = hdr->tail; tail != head; ++tail, ++got) {
+                        p = data + (tail & (hdr->size - 1)) * hdr->sample_size;
+                        *last = (p[0] << 8) | p[1];
+                        DEBUG("%d\n", *last);
+                }
+                __sync_synchronize(); /* done with the samples before tail */
+                hdr->tail = tail;
+
+                /* only sleep when the ring is empty */
+                if (got < samples && hdr->head == tail &&
+                    ioctl(fd, ADC_IOC_WAIT) < 0) {
+                        perror("ioctl(ADC_IOC_WAIT)");
+                        break;
+                }
+        }
+        fprintf(stderr, "overruns=%u\n", hdr->overruns);
+        munmap((void *)hdr, size);
+        return got;
+}
+
+int main(int argc, char ** argv) {
+        int unit, period, samples, fd, i, got = 0, n = 0, last = -1, use_mmap = 0;
+        char adc_file[] = "/dev/adc?";
+        uint8_t buf[4096];
+        struct adc_stream cfg;
+        struct timeval start, end;
+        double secs;
+
+        /* check args */
+        if (argc == 5 && strcmp(argv[4], "mmap") == 0) {
+                use_mmap = 1;
+                argc--;
+        }
+        if (argc != 4 ||
+            sscanf(argv[1], "%i", &unit) != 1 || unit < 0 || unit > 9 ||
+            sscanf(argv[2], "%i", &period) != 1 || period < 1 ||
+            sscanf(argv[3], "%i", &samples) != 1 || samples < 1)
+                usage(argv[0]);
+
+        adc_file[8] = '0' + unit;
+        fd = open(adc_file, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "open(%s): ", adc_file);
+                perror(NULL);
+                exit(errno);
+        }
+
+        cfg.mask = 1 << unit;
+        cfg.period_us = period;
+        cfg.flags = 0;
+        if (ioctl(fd, ADC_IOC_STREAM_START, &cfg) < 0) {
+                perror("ioctl(ADC_IOC_STREAM_START)");
+                exit(errno);
+        }
+
+        gettimeofday(&start, NULL);
+        if (use_mmap)
+                got = consume_mmap(fd, samples, &last);
+        while (got < samples) {
+                n = read(fd, buf, sizeof(buf));
+                if (n <= 0) {
+                        perror("read");
+                        break;
+                }
+                for (i = 0; i + 1 < n; i += 2)
+                        DEBUG("%d\n", (buf[i] << 8) | buf[i + 1]);
+                if (n > 1)
+                        last = (buf[n - 2] << 8) | buf[n - 1];
+                got += n / 2;
+        }
+        gettimeofday(&end, NULL);
+
+        /* closing fd stops the stream too */
+        if (ioctl(fd, ADC_IOC_STREAM_STOP) < 0)
+                perror("ioctl(ADC_IOC_STREAM_STOP)");
+        close(fd);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("samples=%d last=%d secs=%.3f samples/sec=%.1f\n",
+               got, last, secs,
+               got / secs);
+        return 0;
+}
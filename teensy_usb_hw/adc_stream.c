@@ -0,0 +1,440 @@
+/* adc_stream.c
+ *
+ *  timer driven adc sampling for the teensy, and the free running
+ *  scan behind the latest value table
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ * How it works: Timer 0 runs in CTC mode and interrupts every
+ * STREAM_TICK_US. Every stream_ticks of those, TIMER0_COMPA_vect
+ * starts a scan: one conversion per channel in stream_mask, lowest
+ * channel first, each started by ADC_vect when the last one is done.
+ * Each sample is stamped with the scan number and the clock at the
+ * start of its conversion, which is when the adc samples the pin.
+ * ADC_vect queues the samples in a ring that only it writes and only
+ * the main loop (stream_pop()) reads, so neither side needs to turn
+ * interrupts off.
+ *
+ * Between scans the adc doesn't sit idle: ADC_vect goes round the
+ * channels in latest_mask one conversion at a time, and every
+ * conversion, scan or not, lands in the latest table. stream_latest()
+ * answers from there without waiting for the adc, so a single read
+ * costs no more than the USB round trip. A channel joins latest_mask
+ * the first time it's asked for. A scan that comes due while such a
+ * conversion is running starts when it's done, up to one conversion
+ * (~104us) late; its time stamps are still right.
+ *
+ * With STREAM_8BIT the scans convert fast and left adjusted, and the
+ * table pauses so it doesn't hold them up; streamed channels still
+ * get their table entry from the scan. The ring only ever takes whole
+ * scans, so the main loop can leave the channel out of the packed
+ * formats: the samples come in mask order.
+ *
+ * stream_hook() lends the whole adc out, to the burst capture: scans
+ * and block samples are skipped and the table waits until it comes
+ * back. Nothing here touches ADCSRA while it's out.
+ *
+ * A block read (block_start()) shares Timer 0 with the stream: every
+ * block_ticks it takes one sample of block_ch, after any scan and
+ * before the table, into a ring of its own. If that ring is full the
+ * sample waits for room instead of getting lost, so the block only
+ * comes out late when the main loop falls behind, or when a hold
+ * takes the adc: ticks that fall in it are skipped, and the block
+ * runs that much longer.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "analog.h"
+#include "adc_stream.h"
+#include "clock.h"
+
+static volatile uint16_t stream_mask = 0;  /* channels to scan, 0 if off */
+static volatile uint16_t stream_ticks;     /* ticks between scans */
+static uint8_t stream_count;               /* channels in stream_mask */
+static volatile uint16_t stream_countdown; /* ticks to the next scan */
+static volatile uint8_t scan_active = 0;   /* a scan is on the adc */
+static volatile uint8_t scan_pending = 0;  /* a scan is due */
+static volatile uint8_t scan_channel;      /* channel the scan is on */
+static volatile uint8_t adc_busy = 0;      /* a conversion is running */
+static volatile uint8_t adc_channel;       /* channel being converted */
+static volatile uint8_t adc_fast;          /* ... with analogStart(, 1) */
+static volatile uint16_t latest_mask = 0;  /* channels in the free running scan */
+static volatile uint8_t latest_channel = 0; /* last one it converted */
+static volatile uint8_t hold = 0;          /* stream_hold() in force */
+static void (* volatile adc_hook)(void);   /* stream_hook() in force */
+static uint8_t flags = 0;                  /* stream_start() flags */
+static volatile uint16_t scan_number;      /* scans started */
+static volatile uint32_t scan_stamp;       /* clock at the current conversion */
+
+static volatile uint16_t block_left = 0;   /* samples still to take */
+static uint16_t block_ticks;               /* ticks between them */
+static volatile uint16_t block_countdown;  /* ticks to the next one */
+static volatile uint8_t block_pending = 0; /* a sample is due */
+static volatile uint8_t block_active = 0;  /* ... and on the adc */
+static uint8_t block_ch, block_id;
+static uint16_t block_popped;              /* samples block_pop()ed */
+static volatile uint16_t block_ring[BLOCK_RING];
+static volatile uint8_t block_head = 0;    /* written by ADC_vect */
+static volatile uint8_t block_tail = 0;    /* written by block_pop() */
+
+static struct stream_sample ring[STREAM_RING];
+static volatile uint8_t ring_head = 0;     /* written by ADC_vect */
+static volatile uint8_t ring_tail = 0;     /* written by stream_pop() */
+
+static volatile struct {
+        uint16_t value;
+        uint32_t stamp;                    /* clock at its conversion */
+} latest[STREAM_NUM_CHANNELS];
+
+/* next channel in stream_mask from @ch on, or STREAM_NUM_CHANNELS */
+static uint8_t next_channel(uint8_t ch) {
+        while (ch < STREAM_NUM_CHANNELS && !(stream_mask & (1 << ch)))
+                ch++;
+        return ch;
+}
+
+/* start a conversion on @ch, fast if @fast, and note when */
+static void start_conversion(uint8_t ch, uint8_t fast) {
+        adc_channel = ch;
+        adc_fast = fast;
+        adc_busy = 1;
+        scan_stamp = clock_now();
+        analogStart(ch, fast);
+}
+
+/* run Timer 0 for the stream or a block read: CTC, divide 16MHz clock
+ * by 8, 200 counts = 100us */
+static void timer_run(void) {
+        if (TIMSK0 & (1<<OCIE0A)) {
+                return;
+        }
+        TCCR0A = (1<<WGM01);
+        TCCR0B = (1<<CS01);
+        OCR0A = 199;
+        TCNT0 = 0;
+        TIMSK0 = (1<<OCIE0A);
+}
+
+/* stop Timer 0 once neither needs it */
+static void timer_idle(void) {
+        uint8_t sreg = SREG;
+
+        cli();
+        if (!stream_mask && !block_left) {
+                TIMSK0 = 0;
+                TCCR0B = 0;
+        }
+        SREG = sreg;
+}
+
+/* the adc is free: start a due scan, or a due block sample, or the
+ * next channel of the free running scan, or leave it idle. Call with
+ * interrupts off */
+static void adc_next(void) {
+        uint8_t ch, i;
+
+        /* the adc is lent out, and its interrupt with it */
+        if (adc_hook) {
+                return;
+        }
+        if (!hold && scan_pending) {
+                scan_pending = 0;
+                scan_number++;
+                /* no room for the whole scan: skip it, the main loop
+                 * isn't keeping up with the stream */
+                if ((uint8_t)(ring_head - ring_tail) + stream_count <= STREAM_RING) {
+                        scan_channel = next_channel(0);
+                        scan_active = 1;
+                        start_conversion(scan_channel, flags & STREAM_8BIT);
+                        return;
+                }
+        }
+        if (!hold && block_pending && (uint8_t)(block_head - block_tail) < BLOCK_RING) {
+                block_pending = 0;
+                block_active = 1;
+                start_conversion(block_ch, 0);
+                return;
+        }
+        if (!hold && latest_mask && !(stream_mask && (flags & STREAM_8BIT))) {
+                ch = latest_channel;
+                for (i = 0; i < STREAM_NUM_CHANNELS; ++i) {
+                        if (++ch >= STREAM_NUM_CHANNELS) {
+                                ch = 0;
+                        }
+                        if (latest_mask & (1 << ch)) {
+                                break;
+                        }
+                }
+                latest_channel = ch;
+                start_conversion(ch, 0);
+                return;
+        }
+        ADCSRA &= ~(1<<ADIE);
+        adc_busy = 0;
+}
+
+uint8_t stream_start(uint16_t mask, uint16_t ticks, uint8_t start_flags) {
+        uint8_t ch;
+
+        if (mask == 0 || mask >> STREAM_NUM_CHANNELS || ticks == 0) {
+                return 1;
+        }
+        if ((start_flags & ~(STREAM_RECORDS | STREAM_8BIT | STREAM_PACKED)) ||
+            (start_flags & (start_flags - 1))) {
+                return 1;
+        }
+        stream_stop();
+
+        stream_count = 0;
+        for (ch = 0; ch < STREAM_NUM_CHANNELS; ++ch) {
+                if (mask & (1 << ch)) {
+                        stream_count++;
+                }
+        }
+        stream_ticks = ticks;
+        stream_countdown = ticks;
+        flags = start_flags;
+        scan_number = 0;
+        ring_tail = ring_head;
+        stream_mask = mask;
+        timer_run();
+        return 0;
+}
+
+void stream_stop(void) {
+        stream_mask = 0;
+        scan_pending = 0;
+        timer_idle();
+        while (scan_active) /* let the last scan finish */ ;
+}
+
+uint8_t block_start(uint8_t id, uint8_t ch, uint16_t n, uint16_t ticks) {
+        if (ch >= STREAM_NUM_CHANNELS || n == 0 || ticks == 0) {
+                return 1;
+        }
+        block_stop();
+
+        block_id = id;
+        block_ch = ch;
+        block_ticks = ticks;
+        block_countdown = 1;
+        block_popped = 0;
+        block_tail = block_head;
+        block_left = n;
+        timer_run();
+        return 0;
+}
+
+void block_stop(void) {
+        block_left = 0;
+        block_pending = 0;
+        timer_idle();
+        while (block_active) /* let the last sample in */ ;
+        block_tail = block_head;
+}
+
+uint8_t block_pop(uint16_t * dst, uint8_t n, uint16_t * offset, uint8_t * id) {
+        uint8_t i, queued = block_head - block_tail;
+
+        /* hold back a short frame while more is on the way */
+        if (queued == 0 || (queued < n && block_left)) {
+                return 0;
+        }
+        *offset = block_popped;
+        *id = block_id;
+        for (i = 0; i < n && block_tail != block_head; ++i) {
+                dst[i] = block_ring[block_tail % BLOCK_RING];
+                block_tail++;
+        }
+        block_popped += i;
+        return i;
+}
+
+uint8_t stream_flags(void) {
+        return flags;
+}
+
+uint8_t stream_pop(struct stream_sample * dst, uint8_t n) {
+        uint8_t i;
+
+        for (i = 0; i < n && ring_tail != ring_head; ++i) {
+                dst[i] = ring[ring_tail % STREAM_RING];
+                ring_tail++;
+        }
+        return i;
+}
+
+void stream_hold(void) {
+        hold = 1;
+        /* whatever came due before is skipped, like during the hold */
+        scan_pending = 0;
+        block_pending = 0;
+        while (adc_busy) /* wait for the adc */ ;
+}
+
+void stream_release(void) {
+        uint8_t sreg = SREG;
+
+        cli();
+        hold = 0;
+        if (!adc_busy) {
+                adc_next();
+        }
+        SREG = sreg;
+}
+
+void stream_hook(void (*hook)(void)) {
+        stream_hold();
+        adc_hook = hook;
+}
+
+void stream_unhook(void) {
+        adc_hook = 0;
+        stream_release();
+}
+
+uint16_t stream_latest(uint8_t ch, uint32_t * stamp) {
+        if (ch >= STREAM_NUM_CHANNELS) {
+                return 0;
+        }
+
+        /* first time: read it the slow way, then keep it fresh */
+        if (!(latest_mask & (1 << ch)) && !adc_hook) {
+                stream_hold();
+                latest[ch].stamp = clock_now();
+                latest[ch].value = analogRead(ch);
+                latest_mask |= 1 << ch;
+                stream_release();
+        }
+
+        return stream_table(ch, stamp);
+}
+
+uint16_t stream_table(uint8_t ch, uint32_t * stamp) {
+        uint8_t sreg;
+        uint16_t val;
+
+        if (ch >= STREAM_NUM_CHANNELS) {
+                return 0;
+        }
+
+        sreg = SREG;
+        cli();
+        val = latest[ch].value;
+        if (stamp) {
+                *stamp = latest[ch].stamp;
+        }
+        SREG = sreg;
+        return val;
+}
+
+uint8_t stream_scan(uint16_t mask, uint16_t * values) {
+        uint8_t ch;
+
+        /* only the main loop hooks, so this can't change under us */
+        if (adc_hook) {
+                return 1;
+        }
+
+        stream_hold();
+        for (ch = 0; ch < STREAM_NUM_CHANNELS; ++ch) {
+                if (mask & (1 << ch)) {
+                        values[ch] = analogRead(ch);
+                }
+        }
+        stream_release();
+        return 0;
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+        if (block_left && --block_countdown == 0) {
+                block_countdown = block_ticks;
+                if (!hold) {
+                        block_pending = 1;
+                }
+        }
+
+        if (stream_mask && --stream_countdown == 0) {
+                stream_countdown = stream_ticks;
+                /* a scan still running means the rate is too high for
+                 * the channel set; just skip this one */
+                if (!scan_active && !hold) {
+                        scan_pending = 1;
+                }
+        }
+
+        if ((scan_pending || block_pending) && !adc_busy && !hold) {
+                adc_next();
+        }
+}
+
+ISR(ADC_vect)
+{
+        uint8_t low;
+        uint16_t val;
+
+        if (adc_hook) {
+                adc_hook();
+                return;
+        }
+
+        low = ADCL;
+        val = (ADCH << 8) | low;
+        if (adc_fast) {
+                val >>= 6;
+        }
+        latest[adc_channel].value = val;
+        latest[adc_channel].stamp = scan_stamp;
+
+        if (block_active) {
+                block_active = 0;
+                block_ring[block_head % BLOCK_RING] = val;
+                block_head++;
+                if (block_left && --block_left == 0) {
+                        timer_idle();
+                }
+                adc_next();
+                return;
+        }
+
+        if (!scan_active) {
+                adc_next();
+                return;
+        }
+
+        /* adc_next() made room for the whole scan */
+        if (adc_fast) {
+                val >>= 2;
+        }
+        ring[ring_head % STREAM_RING].sample = STREAM_SAMPLE(scan_channel, val);
+        ring[ring_head % STREAM_RING].scan = scan_number;
+        ring[ring_head % STREAM_RING].stamp = scan_stamp;
+        ring_head++;
+
+        scan_channel = next_channel(scan_channel + 1);
+        if (scan_channel < STREAM_NUM_CHANNELS) {
+                start_conversion(scan_channel, adc_fast);
+        } else {
+                scan_active = 0;
+                adc_next();
+        }
+}
@@ -0,0 +1,114 @@
+/* adc_stream.h
+ *
+ *  timer driven adc sampling for the teensy: a channel set is scanned
+ *  at a fixed rate, and the samples queue up until the main loop
+ *  streams them to kernel land. In between, the adc keeps the latest
+ *  value of every channel that's been read fresh.
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ */
+#ifndef __ADC_STREAM_H__
+#define __ADC_STREAM_H__
+
+#include <stdint.h>
+
+/* packet id of the frames we send on our own; same as
+ * TEENSY_STREAM_ID in ../usb_driver/teensy.h */
+#define STREAM_PACKET_ID 0xffff
+
+/* the scan timer ticks every STREAM_TICK_US; same as
+ * ADC_STREAM_TICK_US in ../usb_driver/teensy_adc.h */
+#define STREAM_TICK_US 100
+
+/* channels, i.e. analogRead() pins */
+#define STREAM_NUM_CHANNELS 12
+
+/* samples queued for the main loop; a power of two, at most 256 */
+#define STREAM_RING 64
+
+/* a queued sample: the channel in the top 4 bits, the 10-bit value
+ * (8-bit with STREAM_8BIT) below; sent to kernel land as is, high
+ * byte first */
+#define STREAM_SAMPLE(ch, val) (((uint16_t)(ch) << 12) | (val))
+
+struct stream_sample {
+        uint16_t sample;        /* STREAM_SAMPLE() */
+        uint16_t scan;          /* number of the scan it's from */
+        uint32_t stamp;         /* clock_now() at the start of its conversion */
+};
+
+/* stream_start() flags, at most one of them: send scan numbers and
+ * time stamps too; convert fast and keep the top 8 bits; send the 10
+ * bits packed 4 samples in 5 bytes. Same as ADC_STREAM_* in
+ * ../usb_driver/teensy_adc.h */
+#define STREAM_RECORDS 0x01
+#define STREAM_8BIT    0x02
+#define STREAM_PACKED  0x04
+
+/* scan the channels in @mask every @ticks STREAM_TICK_US; replaces
+ * any running stream. @return: 0 on success */
+uint8_t stream_start(uint16_t mask, uint16_t ticks, uint8_t flags);
+void stream_stop(void);
+
+/* the flags the running stream was started with */
+uint8_t stream_flags(void);
+
+/* pop up to @n queued samples into @dst; @return: how many */
+uint8_t stream_pop(struct stream_sample * dst, uint8_t n);
+
+/* samples a block read queues for the main loop; a power of two, at
+ * most 256 */
+#define BLOCK_RING 32
+
+/* take @n samples of @ch, one every @ticks STREAM_TICK_US, alongside
+ * any stream; replaces any block read under way. @return: 0 on
+ * success */
+uint8_t block_start(uint8_t id, uint8_t ch, uint16_t n, uint16_t ticks);
+void block_stop(void);
+
+/* pop up to @n samples of the block read into @dst, with where they
+ * go in *@offset and the block's id in *@id; holds back fewer than @n
+ * until the block is done. @return: how many */
+uint8_t block_pop(uint16_t * dst, uint8_t n, uint16_t * offset, uint8_t * id);
+
+/* keep the stream off the adc while the caller uses analogRead() */
+void stream_hold(void);
+void stream_release(void);
+
+/* hold the adc and have ADC_vect call @hook for every conversion
+ * instead, until stream_unhook(); for capture.c */
+void stream_hook(void (*hook)(void));
+void stream_unhook(void);
+
+/* the latest value of channel @ch, and in *@stamp, if not NULL, the
+ * clock_now() it was taken at; the first call for a channel reads it
+ * and adds it to the free running scan, unless a hook has the adc */
+uint16_t stream_latest(uint8_t ch, uint32_t * stamp);
+
+/* the same, but only what the table holds, without reading anything;
+ * safe from ISRs. Call stream_latest() once first. */
+uint16_t stream_table(uint8_t ch, uint32_t * stamp);
+
+/* convert the channels in @mask back to back, lowest first, into
+ * @values, by channel; the stream and the table wait meanwhile.
+ * @return: 0 on success, 1 if a hook has the adc */
+uint8_t stream_scan(uint16_t mask, uint16_t * values);
+
+#endif
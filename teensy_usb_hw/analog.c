@@ -5,6 +5,10 @@
 
 #include "analog.h"
 
+/* adc clock: 16MHz / 128 for the full 10 bits, or / 16 (13us a
+ * conversion) when only the top 8 are wanted */
+#define ANALOG_PRESCALE(fast) \
+        ((fast) ? (1<<ADPS2) : (1<<ADPS2)|(1<<ADPS1)|(1<<ADPS0))
 
 #if defined(__AVR_ATmega32U4__)
 
@@ -14,28 +18,45 @@ static const uint8_t PROGMEM adc_mapping[] = {
         0, 1, 4, 5, 6, 7, 13, 12, 11, 10, 9, 8
 };
 
-int analogRead(uint8_t pin)
+/* point the adc mux at @pin, with @adlar or'ed into ADMUX; @return: 0
+ * if there's no such pin */
+static uint8_t analogMux(uint8_t pin, uint8_t adlar)
 {
-        uint8_t low, adc;
+        uint8_t adc;
 
         if (pin >= 12) return 0;
         adc = pgm_read_byte(adc_mapping + pin);
         if (adc < 8) {
                 DIDR0 |= (1 << adc);
                 ADCSRB = 0;
-                ADMUX = analog_reference_config_val | adc;
+                ADMUX = analog_reference_config_val | adlar | adc;
         } else {
                 adc -= 8;
                 DIDR2 |= (1 << adc);
                 ADCSRB = (1<<MUX5);
-                ADMUX = analog_reference_config_val | adc;
+                ADMUX = analog_reference_config_val | adlar | adc;
         }
+        return 1;
+}
+
+int analogRead(uint8_t pin)
+{
+        uint8_t low;
+
+        if (!analogMux(pin, 0)) return 0;
 	ADCSRA = (1<<ADSC)|(1<<ADEN)|(1<<ADPS2)|(1<<ADPS1)|(1<<ADPS0);
         while (ADCSRA & (1<<ADSC)) ;
         low = ADCL;
         return (ADCH << 8) | low;
 }
 
+void analogStart(uint8_t pin, uint8_t fast)
+{
+        if (!analogMux(pin, fast ? (1<<ADLAR) : 0)) return;
+        /* writing ADIF clears a flag left behind by analogRead() */
+	ADCSRA = (1<<ADSC)|(1<<ADEN)|(1<<ADIE)|(1<<ADIF)|ANALOG_PRESCALE(fast);
+}
+
 #elif defined(__AVR_AT90USB646__) || defined(__AVR_AT90USB1286__)
 
 uint8_t analog_reference_config_val = 0x40;
@@ -53,5 +74,13 @@ int analogRead(uint8_t pin)
         return (ADCH << 8) | low;
 }
 
+void analogStart(uint8_t pin, uint8_t fast)
+{
+	if (pin >= 8) return;
+        DIDR0 |= (1 << pin);
+        ADMUX = analog_reference_config_val | (fast ? (1<<ADLAR) : 0) | pin;
+	ADCSRA = (1<<ADSC)|(1<<ADEN)|(1<<ADIE)|(1<<ADIF)|ANALOG_PRESCALE(fast);
+}
+
 #endif
 
@@ -5,9 +5,14 @@
 
 #if defined(__AVR_AT90USB162__)
 #define analogRead(pin) (0)
+#define analogStart(pin, fast)
 #define analogReference(ref)
 #else
 int16_t analogRead(uint8_t pin);
+/* start a conversion on @pin and return at once; the result comes in
+ * on ADC_vect. If @fast, the adc clock runs 8 times faster and the
+ * result is left adjusted, good for the top 8 bits only */
+void analogStart(uint8_t pin, uint8_t fast);
 extern uint8_t analog_reference_config_val;
 #define analogReference(ref) (analog_reference_config_val = (ref) << 6)
 #endif
@@ -0,0 +1,156 @@
+/* capture.c
+ *
+ *  burst capture for the teensy
+ *
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ * How it works: capture_arm() takes the adc off the stream and the
+ * latest value table with stream_hook(), and runs it free, fast and
+ * left adjusted on one channel: a conversion every 13us.
+ * capture_sample() keeps the top 8 bits in a ring of CAPTURE_SAMPLES.
+ * While armed it waits for pre samples of history, then for the
+ * trigger; from the trigger on it takes CAPTURE_SAMPLES - pre more,
+ * so the ring ends up holding the history and what came after, oldest
+ * at head. Then it stops the adc, and the main loop hands the adc
+ * back and sends the ring out with capture_next().
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "analog.h"
+#include "adc_stream.h"
+#include "capture.h"
+
+#define CAPTURE_IDLE      0
+#define CAPTURE_ARMED     1 /* waiting for the trigger */
+#define CAPTURE_TRIGGERED 2 /* taking the rest */
+#define CAPTURE_DONE      3 /* the adc is off, the ring is full */
+#define CAPTURE_SENDING   4 /* capture_next() is sending it */
+
+static uint8_t ring[CAPTURE_SAMPLES];
+static volatile uint16_t head;             /* next slot */
+static volatile uint16_t history;          /* samples in before the trigger */
+static volatile uint16_t left;             /* samples to take after it */
+static volatile uint8_t state = CAPTURE_IDLE;
+static uint8_t trigger, level, prev, capture_id;
+static uint16_t pre;
+static uint16_t sent;                      /* samples sent so far */
+
+/* has the signal gone from @prev to @val the way trigger wants? */
+static uint8_t fired(uint8_t prev, uint8_t val) {
+        switch (trigger) {
+        case CAPTURE_RISING:
+                return prev < level && val >= level;
+        case CAPTURE_FALLING:
+                return prev > level && val <= level;
+        case CAPTURE_ABOVE:
+                return val >= level;
+        case CAPTURE_BELOW:
+                return val <= level;
+        }
+        return 1;
+}
+
+/* the stream_hook(): runs from ADC_vect for every conversion */
+static void capture_sample(void) {
+        uint8_t val = ADCH;
+
+        ring[head] = val;
+        head = (head + 1) % CAPTURE_SAMPLES;
+
+        if (state == CAPTURE_ARMED) {
+                /* fill the history first, and have a prev for edges */
+                if (history < pre || history == 0) {
+                        history++;
+                } else if (fired(prev, val)) {
+                        state = CAPTURE_TRIGGERED;
+                }
+                prev = val;
+                if (state == CAPTURE_ARMED) {
+                        return;
+                }
+        }
+
+        if (--left == 0) {
+                ADCSRA &= ~((1<<ADATE) | (1<<ADIE));
+                state = CAPTURE_DONE;
+        }
+}
+
+uint8_t capture_arm(uint8_t id, uint8_t ch, uint8_t trig, uint8_t lvl,
+                    uint16_t pre_samples) {
+        if (ch >= STREAM_NUM_CHANNELS || trig > CAPTURE_BELOW ||
+            pre_samples >= CAPTURE_SAMPLES) {
+                return 1;
+        }
+        capture_cancel();
+
+        capture_id = id;
+        trigger = trig;
+        level = lvl;
+        pre = trig == CAPTURE_NOW ? 0 : pre_samples;
+        head = 0;
+        history = 0;
+        left = CAPTURE_SAMPLES - pre;
+        state = trig == CAPTURE_NOW ? CAPTURE_TRIGGERED : CAPTURE_ARMED;
+
+        /* free running: ADTS is 0 in ADCSRB */
+        stream_hook(capture_sample);
+        analogStart(ch, 1);
+        ADCSRA |= (1<<ADATE);
+        return 0;
+}
+
+void capture_cancel(void) {
+        if (state == CAPTURE_ARMED || state == CAPTURE_TRIGGERED ||
+            state == CAPTURE_DONE) {
+                ADCSRA &= ~((1<<ADATE) | (1<<ADIE));
+                stream_unhook();
+        }
+        state = CAPTURE_IDLE;
+}
+
+uint8_t capture_next(uint8_t * dst, uint8_t n, uint16_t * offset, uint8_t * id) {
+        uint8_t i;
+
+        if (state == CAPTURE_DONE) {
+                stream_unhook();
+                sent = 0;
+                state = CAPTURE_SENDING;
+        }
+        if (state != CAPTURE_SENDING) {
+                return 0;
+        }
+
+        if (n > CAPTURE_SAMPLES - sent) {
+                n = CAPTURE_SAMPLES - sent;
+        }
+        for (i = 0; i < n; ++i) {
+                dst[i] = ring[(head + sent + i) % CAPTURE_SAMPLES];
+        }
+        *offset = sent;
+        *id = capture_id;
+        sent += n;
+        if (sent == CAPTURE_SAMPLES) {
+                state = CAPTURE_IDLE;
+        }
+        return n;
+}
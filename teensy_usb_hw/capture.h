@@ -0,0 +1,54 @@
+/* capture.h
+ *
+ *  burst capture for the teensy: one channel sampled as fast as the
+ *  adc goes into SRAM, then sent to kernel land in one go
+ *
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+/* samples in a capture, 8 bits each; same as ADC_CAPTURE_SAMPLES in
+ * ../usb_driver/teensy_adc.h */
+#define CAPTURE_SAMPLES 1024
+
+/* when a capture starts; same as ADC_TRIGGER_* */
+#define CAPTURE_NOW     0
+#define CAPTURE_RISING  1
+#define CAPTURE_FALLING 2
+#define CAPTURE_ABOVE   3
+#define CAPTURE_BELOW   4
+
+/* capture @ch, starting on @trigger at @level and keeping @pre samples
+ * from before it; @id goes out with the capture. Replaces any capture
+ * armed or on its way out. @return: 0 on success */
+uint8_t capture_arm(uint8_t id, uint8_t ch, uint8_t trigger, uint8_t level,
+                    uint16_t pre);
+void capture_cancel(void);
+
+/* once a capture is done, copy the next up to @n samples of it, oldest
+ * first, to @dst, with where they go in *@offset and the capture's id
+ * in *@id. @return: how many, 0 when there's nothing to send */
+uint8_t capture_next(uint8_t * dst, uint8_t n, uint16_t * offset, uint8_t * id);
+
+#endif
@@ -0,0 +1,60 @@
+/* clock.c
+ *
+ *  a free-running clock for the teensy, off Timer 3
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ * Timer 3 counts 16MHz / 8 in normal mode, so TCNT3 is the low 16
+ * bits of the clock and TIMER3_OVF_vect counts the high 16.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "clock.h"
+
+static volatile uint16_t clock_high = 0;
+
+void clock_init(void) {
+        TCCR3A = 0;
+        TCCR3B = (1<<CS31);
+        TCNT3 = 0;
+        TIMSK3 |= (1<<TOIE3);
+}
+
+uint32_t clock_now(void) {
+        uint8_t sreg = SREG;
+        uint16_t high, low;
+
+        cli();
+        low = TCNT3;
+        high = clock_high;
+        /* an overflow that hasn't been counted yet */
+        if ((TIFR3 & (1<<TOV3)) && low < 0x8000) {
+                high++;
+        }
+        SREG = sreg;
+
+        return ((uint32_t)high << 16) | low;
+}
+
+ISR(TIMER3_OVF_vect)
+{
+        clock_high++;
+}
@@ -0,0 +1,40 @@
+/* clock.h
+ *
+ *  a free-running clock for the teensy, off Timer 3
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ */
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+
+/* the clock ticks every CLOCK_TICK_NS; same as ADC_DEVICE_TICK_NS in
+ * ../usb_driver/teensy_adc.h. 32 bits of it wrap after about 35
+ * minutes. */
+#define CLOCK_TICK_NS 500
+
+/* start Timer 3 free-running; the compare units stay free for others */
+void clock_init(void);
+
+/* the time now, safe from ISRs and the main loop alike */
+uint32_t clock_now(void);
+
+#endif
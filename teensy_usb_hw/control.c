@@ -0,0 +1,202 @@
+/* control.c
+ *
+ *  closed loop control on the teensy
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ * How it works: Timer 3's compare B interrupts CONTROL_HZ times a
+ * second while any loop runs, stepping OCR3B on by a period each time,
+ * so the passes don't drift with how long they take. Each pass takes
+ * its input from the latest value table (see adc_stream.c), which the
+ * free running scan keeps fresh without waiting for the adc, and sets
+ * the motor through motor_command(). So no pass waits for USB or the
+ * main loop. The gains are fixed point, 1/256ths, and the derivative
+ * is taken on the input so a new setpoint doesn't kick the motor. The
+ * integral stops winding up while the output is clamped.
+ *
+ * The input is only as fresh as the table: a capture, or an 8-bit
+ * stream that doesn't include the channel, holds it still. The
+ * telemetry stamp says when it was taken.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "control.h"
+#include "adc_stream.h"
+#include "clock.h"
+#include "motor.h"
+
+#define CONTROL_TICKS (1000000000UL / CONTROL_HZ / CLOCK_TICK_NS)
+
+/* written by TIMER3_COMPB_vect, or with interrupts off */
+static struct control {
+        uint8_t running;
+        uint8_t ch;
+        uint16_t setpoint;
+        int16_t kp, ki, kd;
+        int16_t out_min, out_max;
+        uint16_t input;         /* last pass's */
+        uint32_t stamp;
+        int16_t error;
+        int16_t output;
+        int32_t integral;
+        uint32_t iterations;
+} controls[MOTOR_NUM];
+
+/* one pass of @unit's loop. Call with interrupts off */
+static void control_step(uint8_t unit) {
+        struct control * c = &controls[unit];
+        uint16_t input;
+        uint32_t stamp;
+        int16_t error;
+        int32_t integral, u;
+
+        input = stream_table(c->ch, &stamp);
+        error = (int16_t)c->setpoint - (int16_t)input;
+
+        integral = c->integral + error;
+        if (integral > CONTROL_INTEGRAL_MAX) {
+                integral = CONTROL_INTEGRAL_MAX;
+        } else if (integral < -CONTROL_INTEGRAL_MAX) {
+                integral = -CONTROL_INTEGRAL_MAX;
+        }
+
+        u = ((int32_t)c->kp * error + (int32_t)c->ki * integral -
+             (int32_t)c->kd * ((int16_t)input - (int16_t)c->input)) / 256;
+
+        /* clamped: keep the integral from pushing further out */
+        if (u > c->out_max) {
+                u = c->out_max;
+                if ((int32_t)c->ki * error > 0) {
+                        integral = c->integral;
+                }
+        } else if (u < c->out_min) {
+                u = c->out_min;
+                if ((int32_t)c->ki * error < 0) {
+                        integral = c->integral;
+                }
+        }
+
+        c->input = input;
+        c->stamp = stamp;
+        c->error = error;
+        c->integral = integral;
+        c->output = u;
+        c->iterations++;
+
+        if (u >= 0) {
+                motor_command(unit, 'f', u);
+        } else {
+                motor_command(unit, 'r', -u);
+        }
+}
+
+uint8_t control_start(uint8_t unit, uint8_t ch, uint16_t setpoint,
+                      int16_t kp, int16_t ki, int16_t kd,
+                      int16_t out_min, int16_t out_max) {
+        struct control * c;
+        uint8_t sreg;
+
+        if (ch >= STREAM_NUM_CHANNELS || setpoint > 0x3ff ||
+            out_min < -CONTROL_OUT_MAX || out_max > CONTROL_OUT_MAX ||
+            out_min > out_max) {
+                return 1;
+        }
+        unit = unit ? 1 : 0;
+        c = &controls[unit];
+
+        control_stop(unit);
+        /* puts ch in the table, and gives the derivative a start */
+        c->input = stream_latest(ch, &c->stamp);
+
+        sreg = SREG;
+        cli();
+        c->ch = ch;
+        c->setpoint = setpoint;
+        c->kp = kp;
+        c->ki = ki;
+        c->kd = kd;
+        c->out_min = out_min;
+        c->out_max = out_max;
+        c->error = 0;
+        c->output = 0;
+        c->integral = 0;
+        c->iterations = 0;
+        c->running = 1;
+        if (!(TIMSK3 & (1<<OCIE3B))) {
+                OCR3B = TCNT3 + CONTROL_TICKS;
+                TIFR3 = (1<<OCF3B);
+                TIMSK3 |= (1<<OCIE3B);
+        }
+        SREG = sreg;
+        return 0;
+}
+
+uint8_t control_setpoint(uint8_t unit, uint16_t setpoint) {
+        uint8_t sreg;
+
+        if (setpoint > 0x3ff) {
+                return 1;
+        }
+        sreg = SREG;
+        cli();
+        controls[unit ? 1 : 0].setpoint = setpoint;
+        SREG = sreg;
+        return 0;
+}
+
+void control_stop(uint8_t unit) {
+        uint8_t sreg = SREG;
+
+        cli();
+        controls[unit ? 1 : 0].running = 0;
+        if (!controls[0].running && !controls[1].running) {
+                TIMSK3 &= ~(1<<OCIE3B);
+        }
+        SREG = sreg;
+}
+
+void control_telemetry(uint8_t unit, struct control_telemetry * t) {
+        struct control * c = &controls[unit ? 1 : 0];
+        uint8_t sreg = SREG;
+
+        cli();
+        t->iterations = c->iterations;
+        t->stamp = c->stamp;
+        t->input = c->input;
+        t->setpoint = c->setpoint;
+        t->error = c->error;
+        t->output = c->output;
+        t->integral = c->integral;
+        t->running = c->running;
+        SREG = sreg;
+}
+
+ISR(TIMER3_COMPB_vect)
+{
+        uint8_t unit;
+
+        OCR3B += CONTROL_TICKS;
+        for (unit = 0; unit < MOTOR_NUM; ++unit) {
+                if (controls[unit].running) {
+                        control_step(unit);
+                }
+        }
+}
@@ -0,0 +1,68 @@
+/* control.h
+ *
+ *  closed loop control on the teensy: a PID loop per motor from an adc
+ *  channel to the motor's PWM, run off Timer 3
+ *
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ */
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include <stdint.h>
+
+/* loop passes a second; same as MC_PID_HZ in ../usb_driver/teensy_mc.h */
+#define CONTROL_HZ 1000
+
+/* outputs go from -CONTROL_OUT_MAX, full reverse, to CONTROL_OUT_MAX */
+#define CONTROL_OUT_MAX 255
+
+/* how far the integral term may wind up, in adc counts */
+#define CONTROL_INTEGRAL_MAX 32767L
+
+struct control_telemetry {
+        uint32_t iterations;    /* loop passes since control_start() */
+        uint32_t stamp;         /* clock_now() the input was taken at */
+        uint16_t input;
+        uint16_t setpoint;
+        int16_t error;          /* setpoint - input */
+        int16_t output;         /* negative is reverse */
+        int32_t integral;
+        uint8_t running;
+};
+
+/* drive motor @unit from adc channel @ch towards @setpoint, with gains
+ * @kp, @ki and @kd in 1/256ths and the output kept in @out_min to
+ * @out_max; replaces any loop on @unit. @return: 0 on success */
+uint8_t control_start(uint8_t unit, uint8_t ch, uint16_t setpoint,
+                      int16_t kp, int16_t ki, int16_t kd,
+                      int16_t out_min, int16_t out_max);
+
+/* move @unit's setpoint, keeping the rest of the loop as it is.
+ * @return: 0 on success */
+uint8_t control_setpoint(uint8_t unit, uint16_t setpoint);
+
+/* stop the loop on @unit, leaving the motor as it last set it */
+void control_stop(uint8_t unit);
+
+/* copy @unit's loop state to @t */
+void control_telemetry(uint8_t unit, struct control_telemetry * t);
+
+#endif
@@ -0,0 +1,295 @@
+/* motor.c
+ *
+ *  the two dc motors on the teensy
+ *
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ *
+ * How it works: motor_command() sets the motor straight away, except
+ * that a motor that was stopped less than MOTOR_LOCKOUT_MS ago only
+ * notes a start for later. motor_poll() checks the lockouts against
+ * the Timer 3 clock and starts what waited. So a stop no longer holds
+ * up the main loop, or the other motor.
+ *
+ * A trajectory is a list of points, each a time after the start and a
+ * command, loaded with motor_load() and started with motor_play(),
+ * or with motor_play_all() so the motors share a start.
+ * Timer 3's compare A interrupts when the next point on either motor
+ * is due, and TIMER3_COMPA_vect plays it through the same lockout as
+ * any other command. A command by hand ends the trajectory.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "motor.h"
+#include "clock.h"
+
+#define MOTOR_LOCKOUT_TICKS (MOTOR_LOCKOUT_MS * (1000000UL / CLOCK_TICK_NS))
+
+static struct motor {
+        uint8_t locked;         /* stopped less than the lockout ago */
+        uint32_t unlock_at;     /* clock_now() when the lockout ends */
+        uint8_t direction;      /* start waiting for the end, 0 if none */
+        uint8_t speed;
+} motors[MOTOR_NUM];
+
+/* trajectories, a point at a time */
+static struct motor_point {
+        uint32_t at;            /* clock ticks after the start */
+        uint8_t direction;
+        uint8_t speed;
+} traj[MOTOR_NUM][MOTOR_TRAJ_POINTS];
+static uint32_t traj_start[MOTOR_NUM];    /* clock_now() at motor_play() */
+static volatile uint8_t traj_len[MOTOR_NUM];  /* points playing, 0 if none */
+static volatile uint8_t traj_next[MOTOR_NUM]; /* next one due */
+
+void motor_init(void) {
+// Set up Timer 1 for PWM control.
+// P&F Correct, Runs 5KHz. Divide 16Mhz clock by 8, cycle = 200.
+// Make OCR1A & B outputs.
+	DDRB |= ((1<<PORTB5) | (1<<PORTB6));
+	//TCCR1A = (1<<COM1A1) | (1<<COM1A0) | (1<<COM1B1) | (1<<COM1B0);
+	TCCR1A = (1<<COM1A1)  | (1<<COM1B1) ; 
+	TCCR1B = (1<<WGM13) | (1<<CS11);
+	ICR1 = 200;
+	OCR1A = 0;	// Should stay low to start
+	OCR1B = 0; 
+
+// Set up Control Signals. PD6&7 for OCR1B; PC6&7 for OCR1A.
+	DDRD |= (1<<PORTD6) | (1<<PORTD7);
+	DDRC |= (1<<PORTC6) | (1<<PORTC7);
+	PORTD &= ~((1<<PORTD6) | (1<<PORTD7));	// take low to start (off)
+	PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
+}
+
+/* drive motor @unit the way @direction says, at @speed */
+static void motor_set(uint8_t unit, uint8_t direction, uint8_t speed) {
+        switch (direction){
+	case 'f':		// Motors Fwd
+	    if (unit == 0) {
+		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));
+		OCR1A = speed;
+		PORTD |= (1<<PORTD6);	
+	    } else {
+		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
+		OCR1B = speed; 
+		PORTC |= (1<<PORTC6);
+	    }
+	    break;
+	case 'r':		// Motors Rev
+	    if (unit == 0) {
+		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));
+		OCR1A = speed;
+		PORTD |= (1<<PORTD7);	
+	    } else {
+		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
+		OCR1B = speed; 
+		PORTC |= (1<<PORTC7);
+	    }
+	    break;
+	case 's':		// Motors Off
+	    if (unit == 0) {
+		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));	// turns off motors
+		OCR1A = 0;
+	    } else {
+		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
+		OCR1B = 0; 
+	    }
+	    break;
+	} // end switch
+}
+
+/* end @unit's lockout if it's over at @now, and start what waited
+ * for it. Call with interrupts off */
+static void motor_unlock(uint8_t unit, uint32_t now) {
+        struct motor * m = &motors[unit];
+
+        if (!m->locked || (int32_t)(now - m->unlock_at) < 0) {
+                return;
+        }
+        m->locked = 0;
+        if (m->direction) {
+                motor_set(unit, m->direction, m->speed);
+                m->direction = 0;
+        }
+}
+
+/* the command itself, lockout and all. Call with interrupts off */
+static void motor_drive(uint8_t unit, uint8_t direction, uint8_t speed, uint32_t now) {
+        struct motor * m = &motors[unit];
+
+        motor_unlock(unit, now);
+
+        if (direction == 's') {
+                // Don't allow another speed command immediately
+                motor_set(unit, 's', 0);
+                m->locked = 1;
+                m->unlock_at = now + MOTOR_LOCKOUT_TICKS;
+                m->direction = 0;
+        } else if (m->locked) {
+                m->direction = direction;
+                m->speed = speed;
+        } else {
+                motor_set(unit, direction, speed);
+        }
+}
+
+/* point Timer 3's compare A at the next point due on either motor,
+ * playing every one that's due on the way; or turn it off when
+ * nothing plays. Call with interrupts off */
+static void traj_schedule(void) {
+        struct motor_point * p;
+        uint32_t now, due, next = 0;
+        uint8_t unit, waiting;
+
+again:
+        now = clock_now();
+        waiting = 0;
+        for (unit = 0; unit < MOTOR_NUM; ++unit) {
+                while (traj_next[unit] < traj_len[unit]) {
+                        p = &traj[unit][traj_next[unit]];
+                        due = traj_start[unit] + p->at;
+                        if ((int32_t)(now - due) < 0) {
+                                if (!waiting || (int32_t)(due - next) < 0) {
+                                        next = due;
+                                }
+                                waiting = 1;
+                                break;
+                        }
+                        motor_drive(unit, p->direction, p->speed, now);
+                        traj_next[unit]++;
+                }
+        }
+
+        if (!waiting) {
+                TIMSK3 &= ~(1<<OCIE3A);
+                return;
+        }
+        /* TCNT3 is the low 16 bits of the clock, so this matches once
+         * every wrap until next comes round */
+        OCR3A = (uint16_t)next;
+        TIFR3 = (1<<OCF3A);
+        TIMSK3 |= (1<<OCIE3A);
+
+        /* too close: TCNT3 went past before OCR3A was set */
+        if ((int32_t)(clock_now() - next) >= 0 && !(TIFR3 & (1<<OCF3A))) {
+                goto again;
+        }
+}
+
+uint8_t motor_command(uint8_t unit, uint8_t direction, uint8_t speed) {
+        uint8_t sreg;
+
+        if (direction != 'f' && direction != 'r' && direction != 's') {
+                return 1;
+        }
+        unit = unit ? 1 : 0;
+
+        sreg = SREG;
+        cli();
+        /* a command by hand ends the trajectory */
+        traj_len[unit] = 0;
+        motor_drive(unit, direction, speed, clock_now());
+        SREG = sreg;
+        return 0;
+}
+
+uint8_t motor_load(uint8_t unit, uint8_t index, uint32_t time_us,
+                   uint8_t direction, uint8_t speed) {
+        uint8_t sreg;
+
+        if (index >= MOTOR_TRAJ_POINTS || time_us > MOTOR_TRAJ_MAX_US ||
+            (direction != 'f' && direction != 'r' && direction != 's')) {
+                return 1;
+        }
+        unit = unit ? 1 : 0;
+
+        sreg = SREG;
+        cli();
+        traj_len[unit] = 0;
+        traj[unit][index].at = time_us * (1000 / CLOCK_TICK_NS);
+        traj[unit][index].direction = direction;
+        traj[unit][index].speed = speed;
+        SREG = sreg;
+        return 0;
+}
+
+/* start @count points of @unit's trajectory at @now. Call with
+ * interrupts off, and traj_schedule() after */
+static void traj_play(uint8_t unit, uint8_t count, uint32_t now) {
+        traj_start[unit] = now;
+        traj_next[unit] = 0;
+        traj_len[unit] = count;
+}
+
+uint8_t motor_play(uint8_t unit, uint8_t count) {
+        uint8_t sreg;
+
+        if (count == 0 || count > MOTOR_TRAJ_POINTS) {
+                return 1;
+        }
+        unit = unit ? 1 : 0;
+
+        sreg = SREG;
+        cli();
+        traj_play(unit, count, clock_now());
+        traj_schedule();
+        SREG = sreg;
+        return 0;
+}
+
+uint8_t motor_play_all(const uint8_t * counts) {
+        uint8_t sreg, unit;
+        uint32_t now;
+
+        for (unit = 0; unit < MOTOR_NUM; ++unit) {
+                if (counts[unit] > MOTOR_TRAJ_POINTS) {
+                        return 1;
+                }
+        }
+
+        sreg = SREG;
+        cli();
+        now = clock_now();
+        for (unit = 0; unit < MOTOR_NUM; ++unit) {
+                if (counts[unit]) {
+                        traj_play(unit, counts[unit], now);
+                }
+        }
+        traj_schedule();
+        SREG = sreg;
+        return 0;
+}
+
+void motor_poll(void) {
+        uint8_t sreg, unit;
+
+        for (unit = 0; unit < MOTOR_NUM; ++unit) {
+                sreg = SREG;
+                cli();
+                motor_unlock(unit, clock_now());
+                SREG = sreg;
+        }
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+        traj_schedule();
+}
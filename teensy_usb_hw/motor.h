@@ -0,0 +1,69 @@
+/* motor.h
+ *
+ *  the two dc motors on the teensy: Timer 1 PWM and the direction
+ *  pins, with a lockout after every stop, and trajectories played off
+ *  Timer 3
+ *
+ *
+ * Copyright (C) 2010 James Larson <jlarson@pacifier.com> and
+ *	Nathan Collins <nathan.collins@gmail.com> and
+ *  	Andrew Sackville-West <andrew@swclan.homelinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301 USA.
+ */
+#ifndef __MOTOR_H__
+#define __MOTOR_H__
+
+#include <stdint.h>
+
+#define MOTOR_NUM 2
+
+/* after a stop, a motor won't start again for this long */
+#define MOTOR_LOCKOUT_MS 500
+
+/* set up Timer 1 and the pins, motors off */
+void motor_init(void);
+
+/* run motor @unit forward ('f') or in reverse ('r') at @speed, or stop
+ * it ('s'). A start during a lockout waits for it to end, and a later
+ * command replaces it. @return: 0 on success */
+uint8_t motor_command(uint8_t unit, uint8_t direction, uint8_t speed);
+
+/* end lockouts that are over and start what waited for them; call
+ * from the main loop */
+void motor_poll(void);
+
+/* points in a trajectory, and how far into it the last may be; same
+ * as MC_TRAJ_POINTS and MC_TRAJ_MAX_US in ../usb_driver/teensy_mc.h */
+#define MOTOR_TRAJ_POINTS 16
+#define MOTOR_TRAJ_MAX_US 1000000000UL
+
+/* set point @index of @unit's trajectory: @direction at @speed,
+ * @time_us after the start; stops any trajectory playing on @unit.
+ * @return: 0 on success */
+uint8_t motor_load(uint8_t unit, uint8_t index, uint32_t time_us,
+                   uint8_t direction, uint8_t speed);
+
+/* play the first @count points of @unit's trajectory, from now.
+ * @return: 0 on success */
+uint8_t motor_play(uint8_t unit, uint8_t count);
+
+/* the same for every motor at once, the first @counts[unit] points
+ * each, all from the same now; a count of 0 leaves that motor be.
+ * @return: 0 on success */
+uint8_t motor_play_all(const uint8_t * counts);
+
+#endif
@@ -30,7 +30,8 @@
 /* unpacked request struct; analogous to struct teensy_request in
  * ../usb_driver/teensy.h */
 struct teensy_msg {
-        uint8_t packet_id; /* packet_id in kernel land version */
+        uint16_t packet_id; /* packet_id in kernel land version; sent
+                             * low byte first */
         uint8_t destination;
         uint8_t size;
         uint8_t *buf;
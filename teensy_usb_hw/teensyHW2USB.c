@@ -43,12 +43,16 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#include <stdlib.h> /* malloc, free */
-#include <string.h> /* memcpy */
+#include <string.h> /* memcpy, memset */
 #include <util/delay.h>
 #include "usb_rawhid.h"
 #include "analog.h"
 #include "pack.h"
+#include "adc_stream.h"
+#include "clock.h"
+#include "capture.h"
+#include "motor.h"
+#include "control.h"
 
 // Forward declarations
 void fail_spectacularly();
@@ -59,58 +63,45 @@ void fail_spectacularly();
 volatile uint8_t do_output=0;
 uint8_t buffer[RAWHID_RX_SIZE];
 
-/* unpack a buffer received from kernel land; inverts pack from kernel land
+/* unpack one sub-frame of a report received from kernel land;
+ * inverts pack from kernel land. A report holds one or more
+ * [packet_id][reserved][size][payload] sub-frames back to back, ended
+ * by a zero size or the end of the report.
  *
- * @buf: buffer from kernel land, packed by
- * ../usb_driver/teensy.c:pack(), of size RAWHID_RX_SIZE
+ * @buf: sub-frame in a buffer from kernel land, packed by
+ * ../usb_driver/teensy.c:pack()
+ * @left: bytes left in the report from @buf on
  *
- * @return: by value teensy_msg with malloc'd .buf: caller is expected
- * to FREE.
+ * @return: by value teensy_msg whose .buf points into @buf, valid
+ * until the next usb_rawhid_recv(); .size is 0 at the end of the
+ * report.
  */
-struct teensy_msg unpack(uint8_t * buf) {
-        struct teensy_msg msg = {
-                .packet_id   = buf[0],
-                .size        = buf[2],
-        };
-        if (msg.size >= 1) {
-                msg.destination = buf[3];
-        } else {
-                fail_spectacularly();
+struct teensy_msg unpack(uint8_t * buf, uint8_t left) {
+        struct teensy_msg msg = { .size = 0 };
+
+        if (left < 2+1 || buf[2] == 0) {
+                return msg; /* end of report */
         }
-                
-        msg.buf = malloc(msg.size - 1);
-        if (!msg.buf) {
-		fail_spectacularly();
-                /* TODO: fail_spectacularly();, here is where we need
-                 * that error message channel! */
+        msg.packet_id = buf[0] | (buf[1] << 8);
+        msg.size      = buf[2];
+        if (2+1 + msg.size > left) {
+                fail_spectacularly();
         }
-        //memcpy(msg.buf,buf+2+1,msg.size);
-	memcpy(msg.buf,buf+2+2,msg.size);
+        msg.destination = buf[3];
+        msg.buf = buf+2+2;
         return msg;
 }
 
-/* pack a teensy_msg for transmission to kernel land; to be inverted
- * by unpack() in kernel land
+/* pack a teensy_msg for transmission to kernel land at @buf; to be
+ * inverted by unpack() in kernel land
  *
- * @msg: msg.size must be <= RAWHID_TX_SIZE - 2
- *
- * @return: malloc'd buf: caller is expected to FREE.
+ * @msg: 2+1 + msg.size must fit in the space left at @buf
  */
-uint8_t * pack(struct teensy_msg msg) {
-        uint8_t * buf = malloc(RAWHID_TX_SIZE);
-        if (!buf) {
-                fail_spectacularly();
-        }
-
-        if (2+1+ msg.size > RAWHID_TX_SIZE) {
-                fail_spectacularly();
-        }
-
-        buf[0] = msg.packet_id;
+void pack(struct teensy_msg msg, uint8_t * buf) {
+        buf[0] = msg.packet_id & 0xff;
+        buf[1] = msg.packet_id >> 8;
         buf[2] = msg.size;
         memcpy(buf+2+1,msg.buf,msg.size);
-        /* leaving garbage in the tail bytes ... */
-        return buf;
 }
 
 /* provide power to PORTD2 for time @time ms */
@@ -122,24 +113,132 @@ void power_portd2(double time) {
         PORTD &= ~(1<<PORTD2);
 }
 
-/* send @msg to kernel land teensy */
+/* replies are batched into tx_buffer, several to a report, and
+ * go out on flush() */
 #define SEND_TIMEOUT 50
+uint8_t tx_buffer[RAWHID_TX_SIZE];
+uint8_t tx_len = 0;
+
+/* send whatever is batched in tx_buffer to kernel land teensy; the
+ * zero padding ends the batch */
+void flush(void) {
+        if (tx_len == 0) {
+                return;
+        }
+        memset(tx_buffer + tx_len, 0, RAWHID_TX_SIZE - tx_len);
+        usb_rawhid_send(tx_buffer, SEND_TIMEOUT);
+        tx_len = 0;
+}
+
+/* queue @msg for kernel land teensy, flushing first if it doesn't fit
+ * in what's left of the report */
 void send(struct teensy_msg msg) {
-        uint8_t * buf = pack(msg);
-        // send the packet
-        usb_rawhid_send(buf, SEND_TIMEOUT);
-        free(buf);
+        if (msg.size == 0 || 2+1 + msg.size > RAWHID_TX_SIZE) {
+                fail_spectacularly();
+        }
+        if (tx_len + 2+1 + msg.size > RAWHID_TX_SIZE) {
+                flush();
+        }
+        pack(msg, tx_buffer + tx_len);
+        tx_len += 2+1 + msg.size;
+}
+
+/* scan the channels in @mask back to back and reply with the mask,
+ * low byte first, then each channel's value, high byte first, lowest
+ * channel first; the mask is 0, and there are no values, while a
+ * capture has the adc */
+void handle_adc_scan(struct teensy_msg msg, uint16_t mask) {
+        uint8_t reply[2 + 2*STREAM_NUM_CHANNELS];
+        uint16_t values[STREAM_NUM_CHANNELS];
+        uint8_t ch, n = 2;
+
+        mask &= (1 << STREAM_NUM_CHANNELS) - 1;
+        if (stream_scan(mask, values)) {
+                mask = 0;
+        }
+        reply[0] = mask & 0xff;
+        reply[1] = mask >> 8;
+
+        for (ch = 0; ch < STREAM_NUM_CHANNELS; ++ch) {
+                if (mask & (1 << ch)) {
+                        reply[n++] = values[ch] >> 8;
+                        reply[n++] = values[ch] & 0xff;
+                }
+        }
+
+        msg.size = n;
+        msg.buf = reply;
+        send(msg);
+}
+
+/* arm a burst capture: msg.buf[0] is ADC_CAPTURE_UNIT, then the id,
+ * channel, trigger and level, then the pre-trigger samples, low byte
+ * first; or cancel it with ADC_CANCEL_UNIT
+ *
+ * replies with a status byte, 0 on success; the capture itself goes
+ * out from capture_poll()
+ */
+#define ADC_CAPTURE_UNIT 0x81
+#define ADC_CANCEL_UNIT 0x82
+
+void handle_adc_capture(struct teensy_msg msg) {
+        uint8_t status = 1;
+
+        /* msg.size counts the destination byte too */
+        if (msg.buf[0] == ADC_CAPTURE_UNIT && msg.size >= 1+1+1+1+1+1+2) {
+                status = capture_arm(msg.buf[1], msg.buf[2], msg.buf[3], msg.buf[4],
+                                     msg.buf[5] | (msg.buf[6] << 8));
+        } else if (msg.buf[0] == ADC_CANCEL_UNIT) {
+                capture_cancel();
+                status = 0;
+        }
+
+        msg.size = sizeof(status);
+        msg.buf = &status;
+        send(msg);
+}
+
+/* start a block read: msg.buf[0] is ADC_BLOCK_UNIT, then the id and
+ * channel, then the number of samples and the ticks between them, low
+ * byte first; or stop it with ADC_UNBLOCK_UNIT
+ *
+ * replies with a status byte, 0 on success; the samples go out from
+ * block_poll()
+ */
+#define ADC_BLOCK_UNIT 0x83
+#define ADC_UNBLOCK_UNIT 0x84
+
+void handle_adc_block(struct teensy_msg msg) {
+        uint8_t status = 1;
+
+        /* msg.size counts the destination byte too */
+        if (msg.buf[0] == ADC_BLOCK_UNIT && msg.size >= 1+1+1+1+2+2) {
+                status = block_start(msg.buf[1], msg.buf[2],
+                                     msg.buf[3] | (msg.buf[4] << 8),
+                                     msg.buf[5] | (msg.buf[6] << 8));
+        } else if (msg.buf[0] == ADC_UNBLOCK_UNIT) {
+                block_stop();
+                status = 0;
+        }
+
+        msg.size = sizeof(status);
+        msg.buf = &status;
+        send(msg);
 }
 
 /* handler for adc msgs
  *
- * @msg: expects adc pin to read in msg.buf[0]
+ * @msg: expects adc pin to read in msg.buf[0], or ADC_SCAN_UNIT
+ * followed by a channel mask, low byte first, to scan, or one of the
+ * capture or block units
  *
  */
+#define ADC_SCAN_UNIT 0x80
 
 void handle_adc(struct teensy_msg msg) {
         uint8_t unit = msg.buf[0]; 
         uint16_t val;
+        uint8_t reply[2];
         /* TODO: use onboard light instead */
 	//power_portd2(500); /* power light for debug */
 
@@ -147,21 +246,288 @@ void handle_adc(struct teensy_msg msg) {
                 fail_spectacularly();
         }
 
+        if (unit == ADC_SCAN_UNIT && msg.size >= 1+1+2) {
+                handle_adc_scan(msg, msg.buf[1] | (msg.buf[2] << 8));
+                return;
+        }
+        if (unit == ADC_CAPTURE_UNIT || unit == ADC_CANCEL_UNIT) {
+                handle_adc_capture(msg);
+                return;
+        }
+        if (unit == ADC_BLOCK_UNIT || unit == ADC_UNBLOCK_UNIT) {
+                handle_adc_block(msg);
+                return;
+        }
+
+        // Latest value of the A/D channel, see adc_stream.c
+	val = stream_latest(unit, NULL);
+	reply[0] = val >> 8;
+	reply[1] = val & 0xff;
+
         //msg.size = ADC_READ_SIZE;
-	msg.size = 2;
-        msg.buf = malloc(msg.size); /* caller still knows orig msg.buf */
-        if (!msg.buf) {
-                fail_spectacularly();
+	msg.size = sizeof(reply);
+        msg.buf = reply;
+        send(msg);
+}
+
+/* handler for adc stream control msgs
+ *
+ * @msg: msg.buf[0] is 'b' to begin streaming, followed by the channel
+ * mask and the period in STREAM_TICK_US ticks, both low byte first,
+ * and optionally stream_start() flags; or 'e' to end it
+ *
+ * replies with a status byte, 0 on success
+ */
+void handle_stream(struct teensy_msg msg) {
+        uint8_t status = 1;
+
+        if (msg.size >= 1+1+2+2 && msg.buf[0] == 'b') {
+                status = stream_start(msg.buf[1] | (msg.buf[2] << 8),
+                                      msg.buf[3] | (msg.buf[4] << 8),
+                                      msg.size >= 1+1+2+2+1 ? msg.buf[5] : 0);
+        } else if (msg.size >= 1+1 && msg.buf[0] == 'e') {
+                stream_stop();
+                status = 0;
         }
 
-        // Read the correct A/D channel
+        msg.size = sizeof(status);
+        msg.buf = &status;
+        send(msg);
+}
 
-	val = analogRead(unit);
-	msg.buf[0]     = val >> 8;
-	msg.buf[1] = val & 0xff;
+/* stream whatever samples the scan has queued up to kernel land, as
+ * frames with packet id STREAM_PACKET_ID and payload
+ *
+ * ['a'][seq][sample]...
+ *
+ * where each sample is STREAM_SAMPLE(), high byte first, and seq
+ * counts frames so kernel land can spot lost ones; or, if the stream
+ * was started with STREAM_RECORDS,
+ *
+ * ['t'][seq][sample][scan][stamp]...
+ *
+ * with the scan number and clock_now() stamp of each sample too, all
+ * high byte first. The packed formats leave the channel out of the
+ * samples, which follow the mask round from the channel ch:
+ *
+ * ['b'][seq][ch][sample]...
+ *
+ * with STREAM_8BIT, one byte each, or with STREAM_PACKED
+ *
+ * ['p'][seq][ch][hi0][hi1][hi2][hi3][lo]...
+ *
+ * the top 8 bits of 4 samples, then their low 2 bits, first sample
+ * highest; the last group may be short, k samples in k+1 bytes
+ */
+#define STREAM_FRAME_PAYLOAD (RAWHID_TX_SIZE - 2-1)
+#define STREAM_FRAME_SAMPLES ((STREAM_FRAME_PAYLOAD - 1-1) / 2)
+#define STREAM_FRAME_RECORDS ((STREAM_FRAME_PAYLOAD - 1-1) / (2+2+4))
+#define STREAM_FRAME_BYTES (STREAM_FRAME_PAYLOAD - 1-1-1)
+#define STREAM_FRAME_PACKED ((STREAM_FRAME_PAYLOAD - 1-1-1) / 5 * 4)
+void stream_poll(void) {
+        static uint8_t seq = 0;
+        struct stream_sample s;
+        uint8_t payload[STREAM_FRAME_PAYLOAD];
+        struct teensy_msg msg = { .packet_id = STREAM_PACKET_ID };
+        uint8_t flags = stream_flags();
+        uint8_t n, k, max, low = 0, *p;
+        uint16_t val;
 
+        if (flags & STREAM_RECORDS) {
+                max = STREAM_FRAME_RECORDS;
+        } else if (flags & STREAM_8BIT) {
+                max = STREAM_FRAME_BYTES;
+        } else if (flags & STREAM_PACKED) {
+                max = STREAM_FRAME_PACKED;
+        } else {
+                max = STREAM_FRAME_SAMPLES;
+        }
+
+        while (stream_pop(&s, 1)) {
+                p = payload;
+                *p++ = flags & STREAM_RECORDS ? 't' :
+                       flags & STREAM_8BIT ? 'b' :
+                       flags & STREAM_PACKED ? 'p' : 'a';
+                *p++ = seq++;
+                if (flags & (STREAM_8BIT | STREAM_PACKED)) {
+                        *p++ = s.sample >> 12;
+                }
+
+                n = 0;
+                do {
+                        val = s.sample & 0x0fff;
+                        if (flags & STREAM_8BIT) {
+                                *p++ = val;
+                        } else if (flags & STREAM_PACKED) {
+                                k = n & 3;
+                                if (k == 0) {
+                                        low = 0;
+                                }
+                                p[k] = val >> 2;
+                                low |= (val & 3) << (6 - 2*k);
+                                if (k == 3) {
+                                        p[4] = low;
+                                        p += 5;
+                                }
+                        } else {
+                                *p++ = s.sample >> 8;
+                                *p++ = s.sample & 0xff;
+                        }
+                        if (flags & STREAM_RECORDS) {
+                                *p++ = s.scan >> 8;
+                                *p++ = s.scan & 0xff;
+                                *p++ = s.stamp >> 24;
+                                *p++ = (s.stamp >> 16) & 0xff;
+                                *p++ = (s.stamp >> 8) & 0xff;
+                                *p++ = s.stamp & 0xff;
+                        }
+                } while (++n < max && stream_pop(&s, 1));
+
+                /* close a short last group */
+                if ((flags & STREAM_PACKED) && (n & 3)) {
+                        p[n & 3] = low;
+                        p += (n & 3) + 1;
+                }
+
+                msg.size = p - payload;
+                msg.buf = payload;
+                send(msg);
+        }
+        flush();
+}
+
+/* send the next piece of a finished capture, if any, as a frame
+ *
+ * ['c'][id][offset][total][sample]...
+ *
+ * offset and total in samples, low byte first, and the samples one
+ * byte each, oldest first; one frame a pass of the main loop, so
+ * requests still get answered while it goes out
+ */
+#define CAPTURE_FRAME_SAMPLES (STREAM_FRAME_PAYLOAD - 1-1-2-2)
+void capture_poll(void) {
+        uint8_t payload[STREAM_FRAME_PAYLOAD];
+        struct teensy_msg msg = { .packet_id = STREAM_PACKET_ID };
+        uint16_t offset;
+        uint8_t n;
+
+        n = capture_next(payload + 1+1+2+2, CAPTURE_FRAME_SAMPLES, &offset, payload + 1);
+        if (n == 0) {
+                return;
+        }
+        payload[0] = 'c';
+        payload[2] = offset & 0xff;
+        payload[3] = offset >> 8;
+        payload[4] = CAPTURE_SAMPLES & 0xff;
+        payload[5] = CAPTURE_SAMPLES >> 8;
+
+        msg.size = 1+1+2+2 + n;
+        msg.buf = payload;
+        send(msg);
+}
+
+/* send the samples a block read has queued, as frames
+ *
+ * ['n'][id][offset][sample]...
+ *
+ * offset in samples, low byte first, and the samples 2 bytes each,
+ * high byte first; only full frames until the block is done
+ */
+#define BLOCK_FRAME_SAMPLES ((STREAM_FRAME_PAYLOAD - 1-1-2) / 2)
+void block_poll(void) {
+        uint16_t samples[BLOCK_FRAME_SAMPLES];
+        uint8_t payload[STREAM_FRAME_PAYLOAD];
+        struct teensy_msg msg = { .packet_id = STREAM_PACKET_ID };
+        uint16_t offset;
+        uint8_t i, n, *p;
+
+        while ((n = block_pop(samples, BLOCK_FRAME_SAMPLES, &offset, payload + 1)) > 0) {
+                payload[0] = 'n';
+                payload[2] = offset & 0xff;
+                payload[3] = offset >> 8;
+                p = payload + 1+1+2;
+                for (i = 0; i < n; ++i) {
+                        *p++ = samples[i] >> 8;
+                        *p++ = samples[i] & 0xff;
+                }
+                msg.size = p - payload;
+                msg.buf = payload;
+                send(msg);
+        }
+}
+
+void handle_mc_traj(struct teensy_msg msg) {
+        uint8_t unit = msg.buf[0], index = msg.buf[1], n, i, *p;
+        uint8_t counts[MOTOR_NUM];
+        uint8_t status = 1;
+
+        if (msg.buf[2] == 'p') {
+                status = motor_play(unit, index);
+        } else if (msg.buf[2] == 'P') {
+                /* msg.size counts the destination byte too */
+                if (msg.size >= 1+1+1+1+1) {
+                        counts[0] = index;
+                        counts[1] = msg.buf[3];
+                        status = motor_play_all(counts);
+                }
+        } else if (msg.size >= 1+1+1+1+1) {
+                /* msg.size counts the destination byte too */
+                n = msg.buf[3];
+                p = msg.buf + 1+1+1+1;
+                if (msg.size >= 1+1+1+1+1 + n * (4+1+1)) {
+                        status = 0;
+                        for (i = 0; i < n && !status; ++i, p += 4+1+1) {
+                                status = motor_load(unit, index + i,
+                                                    p[0] | ((uint32_t)p[1] << 8) |
+                                                    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24),
+                                                    p[4], p[5]);
+                        }
+                }
+        }
+
+        msg.size = sizeof(status);
+        msg.buf = &status;
+        send(msg);
+}
+
+/* a 16 bit value at @p, low byte first */
+#define LE16(p) ((p)[0] | ((uint16_t)(p)[1] << 8))
+
+void handle_mc_control(struct teensy_msg msg) {
+        uint8_t unit = msg.buf[0], *p = msg.buf + 1+1+1;
+        uint8_t reply[1+4+4+2+2+2+2+4+1];
+        struct control_telemetry t;
+
+        /* msg.size counts the destination byte too */
+        reply[0] = 1;
+        if (msg.buf[2] == 'c' && msg.size >= 1+1+1+1 + 6*2) {
+                reply[0] = control_start(unit, msg.buf[1], LE16(p),
+                                         LE16(p + 2), LE16(p + 4), LE16(p + 6),
+                                         LE16(p + 8), LE16(p + 10));
+        } else if (msg.buf[2] == 'v' && msg.size >= 1+1+1+1 + 2) {
+                reply[0] = control_setpoint(unit, LE16(p));
+        }
+        msg.size = 1;
+        if (msg.buf[2] == 'g') {
+                control_telemetry(unit, &t);
+                reply[0] = 0;
+                p = reply + 1;
+                *p++ = t.iterations; *p++ = t.iterations >> 8;
+                *p++ = t.iterations >> 16; *p++ = t.iterations >> 24;
+                *p++ = t.stamp; *p++ = t.stamp >> 8;
+                *p++ = t.stamp >> 16; *p++ = t.stamp >> 24;
+                *p++ = t.input; *p++ = t.input >> 8;
+                *p++ = t.setpoint; *p++ = t.setpoint >> 8;
+                *p++ = t.error; *p++ = t.error >> 8;
+                *p++ = t.output; *p++ = t.output >> 8;
+                *p++ = t.integral; *p++ = t.integral >> 8;
+                *p++ = t.integral >> 16; *p++ = t.integral >> 24;
+                *p++ = t.running;
+                msg.size = p - reply;
+        }
+
+        msg.buf = reply;
         send(msg);
-        free(msg.buf);
 }
 
 void handle_mc(struct teensy_msg msg) {
@@ -169,6 +535,7 @@ void handle_mc(struct teensy_msg msg) {
 		speed     = msg.buf[1],
                 direction = msg.buf[2]; 
         char reply[] = "( , ) received in handle_mc()";
+        uint8_t i;
         reply[1] = '0'+speed; reply[3] = direction;
 
         /* TODO: use onboard light instead */
@@ -178,68 +545,51 @@ void handle_mc(struct teensy_msg msg) {
         if (msg.size < 1+1+1) {
                 fail_spectacularly();
         }
-/*
- * handled as default in switch below **
-        if (direction != 'f' && direction != 'r') {
-                fail_spectacularly();
+        /* trajectories: 't' loads msg.buf[4] points from index speed
+         * on, each the time in us, low byte first, then direction and
+         * speed; 'p' plays the first speed points. 'P' plays the first
+         * speed points of motor 0 and the first msg.buf[3] of motor 1
+         * from the same instant, whatever the unit; a count of 0
+         * leaves that motor be. All reply with a status byte, 0 on
+         * success. */
+        /* closed loop control, see control.c: 'c' starts a loop from
+         * adc channel speed with the setpoint, kp, ki, kd, min and max
+         * output that follow, 16 bits each, low byte first; 'v' moves
+         * the setpoint; both reply with a status byte. 'g' replies
+         * with the status and the loop's telemetry. */
+        if (direction == 'c' || direction == 'v' || direction == 'g') {
+                handle_mc_control(msg);
+                return;
+        }
+        /* anything else takes the motor back from its loop; a joint
+         * play takes both */
+        if (direction == 'P') {
+                for (i = 0; i < MOTOR_NUM; ++i) {
+                        control_stop(i);
+                }
+        } else {
+                control_stop(unit);
         }
-*/
-
-        switch (direction){
-	case 'f':		// Motors Fwd
-	    if (unit == 0) {
-		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));
-		OCR1A = speed;
-		PORTD |= (1<<PORTD6);	
-	    } else {
-		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
-		OCR1B = speed; 
-		PORTC |= (1<<PORTC6);
-	    }
-	    break;
-	case 'r':		// Motors Rev
-	    if (unit == 0) {
-		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));
-		OCR1A = speed;
-		PORTD |= (1<<PORTD7);	
-	    } else {
-		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
-		OCR1B = speed; 
-		PORTC |= (1<<PORTC7);
-	    }
-	    break;
-	case 's':		// Motors Off
-	    if (unit == 0) {
-		PORTD &= ~((1<<PORTD6) | (1<<PORTD7));	// turns off motors
-		OCR1A = 0;
-		_delay_ms(500); 	// Don't allow another speed command immediately
-	    } else {
-		PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
-		OCR1B = 0; 
-		_delay_ms(500);
-	// This is just for testing!
-	//	fail_spectacularly();
-	    }
-	    break;
-	default:
-		fail_spectacularly();
-	    break;
-	} // end switch
 
-        msg.size = sizeof(reply);
-        msg.buf = malloc(msg.size); /* caller still knows orig msg.buf */
-        if (!msg.buf) {
+        if (direction == 't' || direction == 'p' || direction == 'P') {
+                handle_mc_traj(msg);
+                return;
+        }
+
+        /* a stop locks the motor out for a while, see motor.c */
+        if (motor_command(unit, direction, speed)) {
                 fail_spectacularly();
         }
-        memcpy(msg.buf,reply,msg.size);
 
+        msg.size = sizeof(reply);
+        msg.buf = (uint8_t *)reply;
         send(msg);
-        free(msg.buf);
 }
 
 int main(void)
 {
         int8_t r;
+        uint8_t off;
     struct teensy_msg msg;
 
 	// set for 16 MHz clock
@@ -255,24 +605,13 @@ int main(void)
 	// and do whatever it does to actually be ready for input
 	_delay_ms(1000);
 
-// Set up Timer 1 for PWM control.
-// P&F Correct, Runs 5KHz. Divide 16Mhz clock by 8, cycle = 200.
-// Make OCR1A & B outputs.
-	DDRB |= ((1<<PORTB5) | (1<<PORTB6));
-	//TCCR1A = (1<<COM1A1) | (1<<COM1A0) | (1<<COM1B1) | (1<<COM1B0);
-	TCCR1A = (1<<COM1A1)  | (1<<COM1B1) ; 
-	TCCR1B = (1<<WGM13) | (1<<CS11);
-	ICR1 = 200;
-	OCR1A = 0;	// Should stay low to start
-	OCR1B = 0; 
-
-// Set up Control Signals. PD6&7 for OCR1B; PC6&7 for OCR1A.
-	DDRD |= (1<<PORTD6) | (1<<PORTD7);
-	DDRC |= (1<<PORTC6) | (1<<PORTC7);
-	PORTD &= ~((1<<PORTD6) | (1<<PORTD7));	// take low to start (off)
-	PORTC &= ~((1<<PORTC6) | (1<<PORTC7));
-
-// Timer 0 is not necessary - leave code in case we later want it.
+	// Free-running clock for time stamps, see clock.c
+	clock_init();
+
+// Timer 1 PWM and the direction pins, see motor.c
+	motor_init();
+
+// Timer 0 paces the adc stream now, see adc_stream.c - this is the old code.
         // Configure timer 0 to generate a timer overflow interrupt every
         // 256*1024 clock cycles, or approx 61 Hz when using 16 MHz clock
 //        TCCR0A = 0x00;
@@ -299,21 +638,37 @@ int main(void)
 	_delay_ms(500);
 	PORTD &= ~(1<<PORTD3);
 	_delay_ms(500);	*/
-            msg = unpack(buffer);
-        switch(msg.destination){
-            case 'a':
-                    handle_adc(msg);
-	            break;
-            case 'm':
-                    handle_mc(msg);
-                    break;
-            default:
-                    fail_spectacularly();
-	            break;
-	}
-            free(msg.buf);
+            /* answer every sub-frame in the report, then send the
+             * batched replies */
+            for (off = 0; ; off += 2+1 + msg.size) {
+                msg = unpack(buffer + off, RAWHID_RX_SIZE - off);
+                if (msg.size == 0) {
+                        break;
+                }
+                switch(msg.destination){
+                case 'a':
+                        handle_adc(msg);
+                        break;
+                case 'm':
+                        handle_mc(msg);
+                        break;
+                case 's':
+                        handle_stream(msg);
+                        break;
+                default:
+                        fail_spectacularly();
+                        break;
+                }
+            }
+            flush();
             // _delay_ms(50);
 		}
+		// end motor lockouts that are over
+		motor_poll();
+		// and keep any capture, block read and adc stream moving
+		capture_poll();
+		block_poll();
+		stream_poll();
 	}
 }
 
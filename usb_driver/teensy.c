@@ -53,118 +53,411 @@ static struct usb_driver teensy_driver = {
 };
 
 /*
- * module-wide data structures
+ * module parameters
  *
  */
 
-/* list, lock and wait_queue for sleeping senders */
-static LIST_HEAD(senders_list);
-spinlock_t senders_lock;
+/* in urbs kept queued on the input endpoint */
+static int in_urbs = TEENSY_DEFAULT_IN_URBS;
+module_param(in_urbs, int, S_IRUGO);
+MODULE_PARM_DESC(in_urbs, "number of in urbs kept queued on the teensy (1-"
+                 __stringify(TEENSY_MAX_IN_URBS) ")");
+
+/* out urbs we let go straight out before new requests are batched */
+static int out_inflight = TEENSY_DEFAULT_OUT_INFLIGHT;
+module_param(out_inflight, int, S_IRUGO);
+MODULE_PARM_DESC(out_inflight, "out urbs in flight before requests are batched (1-"
+                 __stringify(TEENSY_NUM_OUT_URBS) ")");
+
+/*
+ * module-wide data structures
+ *
+ */
 
-wait_queue_head_t senders_queue;
+/* table and lock for sleeping senders
+ *
+ * senders_table is indexed by the low bits of the packet id
+ * (TEENSY_SLOT()), so finding the sender for a reply, adding a sender
+ * and removing one are all O(1) no matter how many requests are in
+ * flight. A new id is never handed out while its slot is taken, and a
+ * reply only completes the sender in its slot if the full 16-bit ids
+ * match; anything else is counted as a collision and dropped, e.g. a
+ * reply with a corrupt id. There is no timeout: a request holds its
+ * slot until its reply comes, it fails to go out, or the teensy is
+ * unplugged, so a teensy that never answers uses the slots up and
+ * teensy_send_async() returns -EBUSY. senders_lock protects both the table and
+ * pkt_id, and is taken from the in callback, so process context must
+ * take it with interrupts disabled.
+ */
+#define TEENSY_SLOT(id) ((id) & (TEENSY_MAX_INFLIGHT - 1))
+static struct teensy_request *senders_table[TEENSY_MAX_INFLIGHT];
+DEFINE_SPINLOCK(senders_lock);
 
+/* the device, NULL while there is none; set and cleared under
+ * senders_lock, so a sender that sees it under the lock can count on
+ * it until it lets go */
 struct usb_teensy *teensy_dev;
 
-/* packet id number and lock*/
-uint8_t pkt_id;
-spinlock_t pkt_id_lock;
+/* next packet id to hand out; protected by senders_lock */
+uint16_t pkt_id;
 
-/* data pack/unpack */
+/* handlers for the frames the teensy sends on its own, by
+ * destination byte; submodules register from their init and
+ * unregister from their exit, which bracket the in urbs, so in_work
+ * never races a change */
+static teensy_stream_t stream_handlers[256];
 
-/* frees req->buf and allocates new req->buf with packed data
+/* slab cache backing the per-device request pools */
+static struct kmem_cache *teensy_req_cache;
+
+/* request pools
+ *
+ * every device keeps a free list of teensy_requests, filled with
+ * TEENSY_POOL_SIZE of them at probe time. Each request carries its
+ * own RAWHID_RX_SIZE frame, so there are no separate buffers to
+ * manage. Getting from an empty list falls back to the slab cache,
+ * and putting always goes back on the list, so the pool grows to the
+ * high water mark and the steady-state request path never calls the
+ * allocator.
  *
- * NOT INTERRUPT MODE SAFE!
+ * A request out of the pool holds a reference on its device, so a
+ * file released after the teensy was unplugged can still give its
+ * request back; the last reference frees the pool and the device.
+ */
+
+static void teensy_release_dev(struct kref *kref);
+
+/*
+ * teensy_alloc_request
  *
- * NOT SAFE TO FREE req->buf IF THIS RETURNS ERROR
+ * get a request from the pool of the current device, with .buf
+ * pointing at the payload slot of its frame and .size set to
+ * zero. The caller writes up to TEENSY_MAX_PAYLOAD bytes into .buf,
+ * sets .size and hands it to teensy_send().
+ *
+ * @return: NULL if there is no device or we're out of memory
+ */
+struct teensy_request * teensy_alloc_request(gfp_t flags)
+{
+        struct usb_teensy *dev;
+        struct teensy_request *req = NULL;
+        unsigned long irq_flags;
+
+        spin_lock_irqsave(&senders_lock, irq_flags);
+        dev = teensy_dev;
+        if (dev)
+                kref_get(&dev->kref);
+        spin_unlock_irqrestore(&senders_lock, irq_flags);
+        if (!dev)
+                return NULL;
+
+        spin_lock_irqsave(&dev->pool_lock, irq_flags);
+        if (!list_empty(&dev->free_reqs)) {
+                req = list_entry(dev->free_reqs.next, struct teensy_request, list);
+                list_del(&req->list);
+        }
+        spin_unlock_irqrestore(&dev->pool_lock, irq_flags);
+
+        if (!req) {
+                DPRINT("teensy_alloc_request(): pool empty, growing\n");
+                req = kmem_cache_alloc(teensy_req_cache, flags);
+                if (!req) {
+                        kref_put(&dev->kref, teensy_release_dev);
+                        return NULL;
+                }
+        }
+
+        req->dev = dev;
+        req->buf = req->frame + TEENSY_HDR_SIZE;
+        req->size = 0;
+        req->status = 0;
+
+        return req;
+}
+EXPORT_SYMBOL(teensy_alloc_request);
+
+/*
+ * teensy_free_request
+ *
+ * give a request back to its pool, and drop its reference on the
+ * device, which may be gone by now
+ */
+void teensy_free_request(struct teensy_request *req)
+{
+        struct usb_teensy *dev;
+        unsigned long irq_flags;
+
+        if (!req)
+                return;
+
+        dev = req->dev;
+
+        spin_lock_irqsave(&dev->pool_lock, irq_flags);
+        list_add(&req->list, &dev->free_reqs);
+        spin_unlock_irqrestore(&dev->pool_lock, irq_flags);
+
+        kref_put(&dev->kref, teensy_release_dev);
+}
+EXPORT_SYMBOL(teensy_free_request);
+
+/* fill the pool of a new device */
+static int init_pools(struct usb_teensy *dev)
+{
+        int i;
+        struct teensy_request *req;
+
+        spin_lock_init(&dev->pool_lock);
+        INIT_LIST_HEAD(&dev->free_reqs);
+
+        for (i = 0; i < TEENSY_POOL_SIZE; ++i) {
+                req = kmem_cache_alloc(teensy_req_cache, GFP_KERNEL);
+                if (!req)
+                        return -ENOMEM;
+                list_add(&req->list, &dev->free_reqs);
+        }
+        return 0;
+}
+
+/* empty the pool of a departing device */
+static void exit_pools(struct usb_teensy *dev)
+{
+        struct teensy_request *req, *tmp;
+
+        list_for_each_entry_safe(req, tmp, &dev->free_reqs, list) {
+                list_del(&req->list);
+                kmem_cache_free(teensy_req_cache, req);
+        }
+}
+
+/* the last reference to @kref's device is gone */
+static void teensy_release_dev(struct kref *kref)
+{
+        struct usb_teensy *dev = container_of(kref, struct usb_teensy, kref);
+
+        exit_pools(dev);
+        usb_put_dev(dev->udev);
+        kfree(dev);
+}
+
+/* data pack/unpack */
+
+/* frames req in place: writes the header into req->frame in front of
+ * the payload the caller already wrote to req->buf, and zeroes the
+ * padding. Nothing is allocated or copied.
+ *
+ * INTERRUPT MODE SAFE
  *
  * @return: < 0 on failure; 0 o/w
  */
 int pack(struct teensy_request * req) {
-        char * packed;
         /* packed data layout:
          *
-         * [packet_id]:   2 bytes
+         * [packet_id]:   2 bytes, low byte first
          * [size]:        1 byte // BREAKS if RAWHID_RX_SIZE gets large
          * [payload]:     N bytes
          * [padding]:     RAWHID_RX_SIZE - 2 - 1 - N bytes
+         *
+         * several of these sub-frames may be batched back to back
+         * in one report; a zero size ends the batch, which is why
+         * the payload may not be empty.
          */
 
         /* validate input */
-        if (req->size + 2+1 > RAWHID_RX_SIZE
+        if (req->size > TEENSY_MAX_PAYLOAD
             || req->size >= 1 << 8) { /* too big for uint_8 */
                 printk(KERN_ERR "pack(): req->size too large: %zu\n", req->size);
                 return -EINVAL;
         }
+        if (req->size == 0) {
+                printk(KERN_ERR "pack(): empty payload\n");
+                return -EINVAL;
+        }
 
-        packed = kzalloc(RAWHID_RX_SIZE,GFP_KERNEL);
-        if (!packed)
-                return -ENOMEM;
-
-        /* pack data */
-        packed[0] = req->packet_id;
-        packed[1] = 0x00;          /* for future use */
-        packed[2] = (uint8_t) req->size;
-        memcpy(packed+2+1,req->buf,req->size);
-        /* zalloc already made pad bytes zero */
-
-        /* free old buf; insert new buf and updated size */
-        kfree(req->buf);
-        req->buf = packed;
-        req->size = RAWHID_RX_SIZE;
+        /* pack header; payload is already in place at req->buf */
+        req->frame[0] = req->packet_id & 0xff;
+        req->frame[1] = req->packet_id >> 8;
+        req->frame[2] = (uint8_t) req->size;
+        memset(req->buf + req->size, 0x00, TEENSY_MAX_PAYLOAD - req->size);
 
         return 0;
 }
 
-/* frees req->buf and allocates new req->buf with unpacked data
+/* the 16-bit packet id of a received @frame */
+static inline uint16_t teensy_frame_id(const unsigned char *frame)
+{
+        return frame[0] | (frame[1] << 8);
+}
+
+/* parses the received @frame of @len bytes in place and copies just
+ * its payload into req->buf; this is the only copy a reply makes
+ * before copy_to_user().
  *
  * INTERRUPT MODE SAFE
  *
  * @return: < 0 on failure; 0 o/w
  */
-int unpack(struct teensy_request * req) {
-        char * unpacked;
+int unpack(struct teensy_request * req, const unsigned char * frame, size_t len) {
         uint8_t size;
 
         /* received format assumed same as setup in pack() */
 
         /* validate input */
         /* ASSUME RAWHID_RX_SIZE == RAWHID_TX_SIZE (true by default) */
-        if (req->size > RAWHID_RX_SIZE) {
-                printk(KERN_WARNING "unpack(): req->size too large: %zu\n", req->size);
+        if (len > RAWHID_RX_SIZE) {
+                printk(KERN_WARNING "unpack(): len too large: %zu\n", len);
                 /* return -EINVAL; */ // not an actual error, but very suspicious
         }
-        /* does buf contain enough data to encode destination and size ? */
-        if (req->size < 1+1) {
-                printk(KERN_ERR "unpack(): req->size too small: %zu\n", req->size);
+        /* does frame contain enough data to encode destination and size ? */
+        if (len < TEENSY_HDR_SIZE) {
+                printk(KERN_ERR "unpack(): len too small: %zu\n", len);
                 return -EINVAL;
         }
-        /* does buf correspond to req ? */
-        if (req->buf[0] != req->packet_id) {
-                printk(KERN_ERR "unpack(): req->buf not for req->dev_t: %c != %c\n",
-                       req->buf[0], req->packet_id);
+        /* does frame correspond to req ? */
+        if (teensy_frame_id(frame) != req->packet_id) {
+                printk(KERN_ERR "unpack(): frame not for req->dev_t: %u != %u\n",
+                       teensy_frame_id(frame), req->packet_id);
                 return -EINVAL;
         }
 
         /* unpack data */
-        size = (uint8_t) req->buf[2];
-        printk(KERN_DEBUG "unpack(): coded rx packet size is: %i\n", size);
-        unpacked = kzalloc(size, GFP_ATOMIC);
-        if (!unpacked)
-                return -ENOMEM;
-        memcpy(unpacked,req->buf+2+1,size);
-
-        /* free old buf; insert new buf and updated size */
-        kfree(req->buf);
-        req->buf = unpacked;
+        size = frame[2];
+        DPRINT("unpack(): coded rx packet size is: %i\n", size);
+        if (size > TEENSY_MAX_PAYLOAD || size + TEENSY_HDR_SIZE > len) {
+                printk(KERN_ERR "unpack(): coded size too large: %i\n", size);
+                return -EINVAL;
+        }
+        memcpy(req->buf, frame + TEENSY_HDR_SIZE, size);
         req->size = size;
 
         return 0;
 }
 
+/* hand the payload of a stream frame to the handler registered for
+ * its destination byte, or drop it and count it */
+static void teensy_dispatch_stream(struct usb_teensy *dev,
+                                   const unsigned char *frame, size_t len,
+                                   ktime_t received)
+{
+        size_t size = frame[2];
+        teensy_stream_t handler;
+
+        if (size + TEENSY_HDR_SIZE > len ||
+            !(handler = stream_handlers[frame[TEENSY_HDR_SIZE]])) {
+                atomic_inc(&dev->in_dropped);
+                return;
+        }
+        handler(frame + TEENSY_HDR_SIZE + 1, size - 1, received);
+}
+
+/*
+ * teensy_dispatch
+ *
+ * hand one reply sub-frame of @len bytes to the sender waiting on its
+ * packet id, or drop it and count it if nobody is waiting, and as a
+ * collision too if another request now holds its slot. Stream frames
+ * go to the handler registered for their destination instead.
+ *
+ * runs from in_work, in process context
+ */
+static void teensy_dispatch(struct usb_teensy *dev, const unsigned char *frame,
+                            size_t len, ktime_t received)
+{
+        int ret;
+        unsigned long flags;
+        uint16_t packet_id;
+        struct teensy_request *req = NULL;
+
+        /* examine the first two bytes */
+        packet_id = teensy_frame_id(frame);
+
+        DPRINT("in-callback got packet_id: %i\n", packet_id);
+
+        if (packet_id == TEENSY_STREAM_ID) {
+                teensy_dispatch_stream(dev, frame, len, received);
+                return;
+        }
+
+        /* lock the table!!! */
+        spin_lock_irqsave(&senders_lock, flags);
+
+        /* look up the sender waiting on this id, if nobody is there,
+         * drop the packet and count it, snoozers are loozers. A
+         * sender we find comes out of the table right away, since its
+         * callback may free it */
+        req = senders_table[TEENSY_SLOT(packet_id)];
+        if (req && req->packet_id != packet_id) {
+                atomic_inc(&dev->in_collisions);
+                req = NULL;
+        } else if (req && !req->complete) {
+                senders_table[TEENSY_SLOT(packet_id)] = NULL;
+
+                /* set teensy_request to completed so no other thread grabs it */
+                req->complete = true; 
+        } else {
+                req = NULL;
+        }
+
+        spin_unlock_irqrestore(&senders_lock, flags);
+
+        if (!req) {
+                atomic_inc(&dev->in_dropped);
+                return;
+        }
+
+        /* unpack the payload straight out of the urb buffer into
+         * req->buf */
+        if ((ret = unpack(req, frame, len)) < 0) {
+                printk(KERN_ERR "teensy_dispatch(): failed unpack(): %d\n", ret);
+                req->status = ret;
+                req->size = 0;
+        }
+
+        /* tell the owner of this request, and only them */
+        req->callback(req);
+}
+
+/*
+ * teensy_in_work
+ *
+ * the bottom half of the reader: empty the in ring, walking each
+ * report's sub-frames until a zero size or the end of the report, and
+ * hand each to its own sender. in_work is the only consumer of the
+ * ring and the in callback the only producer, so no lock is needed;
+ * the barriers order the slot contents against the indices.
+ */
+static void teensy_in_work(struct work_struct *work)
+{
+        struct usb_teensy *dev = container_of(work, struct usb_teensy, in_work);
+        struct teensy_in_slot *slot;
+        unsigned int tail;
+        size_t off, flen;
+
+        for (tail = dev->in_tail; tail != ACCESS_ONCE(dev->in_head); ) {
+                smp_rmb(); /* read the slot only after seeing in_head */
+                slot = &dev->in_ring[tail & (TEENSY_IN_RING - 1)];
+
+                for (off = 0; off + TEENSY_HDR_SIZE <= slot->len; off += flen) {
+                        if (!slot->data[off + 2])
+                                break;
+                        flen = TEENSY_HDR_SIZE + slot->data[off + 2];
+                        teensy_dispatch(dev, slot->data + off, slot->len - off,
+                                        slot->received);
+                }
+
+                smp_mb(); /* done with the slot before giving it back */
+                dev->in_tail = ++tail;
+        }
+}
+
 /*
  * teensy_interrupt_in_callback
  *
- * callback function to handle data coming on from teensy
+ * callback function to handle data coming on from teensy: copy the
+ * raw report into the in ring, kick in_work to deal with it, and
+ * resubmit. Nothing else happens here, so the time we spend with
+ * interrupts off doesn't depend on how many requests a report answers
+ * or what their callbacks do; the longest so far is in the
+ * in_irq_max_ns sysfs attribute.
  *
  * note, this runs in interrupt context, play nice!
  *
@@ -172,170 +465,484 @@ int unpack(struct teensy_request * req) {
 static void teensy_interrupt_in_callback (struct urb *urb) 
 {
         struct usb_teensy *dev;
+        struct teensy_in_slot *slot;
+        unsigned int head;
+        ktime_t start;
+        s64 ns;
         int status;
         int ret;
-	//int i;   // only used for debug
-
-        struct list_head *curr;
-        char packet_id;
-        struct teensy_request *req = NULL;
-                                
-        DPRINT("interrupt_in callback called\n");
 
         if (!urb)
-                goto reset;
+                return;
         
+        start = ktime_get();
         dev = urb->context;
         status = urb->status;
         
-        if (status != 0){
-                if ((status != -ENOENT) && (status != -ECONNRESET) &&
-                    (status != -ESHUTDOWN)) {
-                        printk(KERN_ERR "teensy: input callback nonzero status received: %d\n", status);
-                        
-                }
+        switch (status) {
+        case 0:
+                break;
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+                /* we're being killed, don't resubmit */
+                return;
+        default:
+                printk(KERN_ERR "teensy: input callback nonzero status received: %d\n", status);
+                atomic_inc(&dev->in_errors);
+                goto resubmit;
         }
 
-        if (urb->actual_length > 0 && dev->in_buf) {
-                
-                /* examine the first byte */
-                packet_id = dev->in_buf[0] & 0x0ff; /* TODO: make this a function */
+        atomic_inc(&dev->in_received);
 
-                DPRINT("in-callback got packet_id: %i\n", packet_id);
-                
-                
-                /* lock the list!!! */
-                spin_lock(&senders_lock);
-
-                /* search senders list for match, if no match, just
-                 * drop the packet, snoozers are loozers */
-                if (!list_empty(&senders_list)) {
-                        list_for_each(curr, &senders_list){
-                                
-                                struct teensy_request *temp = list_entry(curr, struct teensy_request, list);
-                                if (temp) {
-                                        if (temp->packet_id == packet_id && !temp->complete) {
-                                                req = temp;
-                                                break;
-                                        }
-                                        
-                                }
-                        }
-                        
-                } else {
-                        //DPRINT("no pending requests! Dropping packet!\n");
-                        goto reset;
-                        
-                }
+        head = dev->in_head;
+        if (head - ACCESS_ONCE(dev->in_tail) >= TEENSY_IN_RING) {
+                atomic_inc(&dev->in_overruns);
+                goto resubmit;
+        }
+        smp_mb(); /* in_work is done with the slot before we fill it */
+        slot = &dev->in_ring[head & (TEENSY_IN_RING - 1)];
+        slot->len = min_t(size_t, urb->actual_length, RAWHID_RX_SIZE);
+        slot->received = start;
+        memcpy(slot->data, urb->transfer_buffer, slot->len);
+        smp_wmb(); /* publish the slot before in_head */
+        dev->in_head = head + 1;
+
+        queue_work(dev->in_wq, &dev->in_work);
+
+resubmit:
+        /* hand the urb straight back; the others in the ring keep the
+         * endpoint covered while we're in here */
+        if ((ret = usb_submit_urb(urb, GFP_ATOMIC)) < 0)
+                printk(KERN_ERR "teensy: failed to resubmit in urb: %d\n", ret);
+
+        ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+        if (ns > dev->in_irq_max_ns)
+                dev->in_irq_max_ns = ns;
+}
 
-                if (req) {
-
-                        /* set teensy_request to completed so no other thread grabs it, lock?  */
-                        req->complete = true; 
-
-                        /* copy the received data into the req and upack */
-                        kfree(req->buf); /* free old buf: we're making new buf */
-                        req->buf = kmalloc(urb->actual_length, GFP_ATOMIC);
-                        if(!req->buf) /* TODO: what do we do ??? */
-                                printk(KERN_ERR "teensy_interrupt_in_callback(): "
-                                       "failed atomic kmalloc: we're hosed!\n"); //return -ENOMEM;
-                        req->size = urb->actual_length;
-                        memcpy(req->buf, dev->in_buf, urb->actual_length);
-			
-                        if ((ret = unpack(req)) < 0) /* TODO: what do we do ??? */
-                                printk(KERN_ERR "teensy_interrupt_in_callback(): "
-                                       "failed unpack(): we're hosed!\n"); //return -EOHNO;
-
-                        /* wakeup the senders wait_queue */
-                        wake_up(&senders_queue); 
-                }
+/* release the packet id of a request that will never be answered
+ *
+ * @return: true if it still had it, false if a reply or
+ * teensy_fail_all() got there first and completed it already
+ */
+static bool teensy_forget_request(struct teensy_request *req)
+{
+        unsigned long flags;
+        bool had = false;
+
+        spin_lock_irqsave(&senders_lock, flags);
+        if (senders_table[TEENSY_SLOT(req->packet_id)] == req) {
+                senders_table[TEENSY_SLOT(req->packet_id)] = NULL;
+                had = true;
         }
-reset:
-        spin_unlock(&senders_lock);
-        
-        usb_submit_urb(urb, GFP_ATOMIC);
+        spin_unlock_irqrestore(&senders_lock, flags);
+        return had;
+}
 
-        DPRINT ("in URB RE-submitted\n");
-        
+/*
+ * teensy_fill_out
+ *
+ * the coalescer: copy as many pending requests as fit, back to back,
+ * into the buffer of @out, zero the rest, and move them from
+ * out_pending into @batch. Call with out_lock held.
+ *
+ * @return: the number of requests batched
+ */
+static int teensy_fill_out(struct usb_teensy *dev, struct teensy_out *out,
+                           struct teensy_request **batch)
+{
+        struct teensy_request *req;
+        size_t len = 0, flen;
+        int n = 0;
+
+        while (!list_empty(&dev->out_pending) && n < TEENSY_MAX_BATCH) {
+                req = list_entry(dev->out_pending.next, struct teensy_request, list);
+                flen = TEENSY_HDR_SIZE + req->size;
+                if (len + flen > RAWHID_RX_SIZE)
+                        break;
+                memcpy(out->buf + len, req->frame, flen);
+                len += flen;
+                list_del(&req->list);
+                batch[n++] = req;
+        }
+        memset(out->buf + len, 0x00, RAWHID_RX_SIZE - len);
+
+        return n;
+}
+
+/* fail a request that never made it out, unless it's been completed
+ * already; @mine is left for the caller to report */
+static void teensy_fail_request(struct teensy_request *req,
+                                struct teensy_request *mine)
+{
+        if (!teensy_forget_request(req) || req == mine)
+                return;
+        req->status = -EIO;
+        req->size = 0;
+        req->complete = true;
+        req->callback(req);
 }
 
 /*
- * teensy_interrupt_out_callback
+ * teensy_submit_out
  *
- * TODO: document
+ * submit a filled out urb. If that fails the device is most likely
+ * going away, so the urb goes back on the free ring and every request
+ * in the batch, and everything still pending, is failed with -EIO,
+ * except @mine, which the caller reports itself. On success the
+ * requests may already be answered and freed by the time we return,
+ * so they are not touched again.
+ *
+ * INTERRUPT MODE SAFE
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int teensy_submit_out(struct teensy_out *out, struct teensy_request **batch,
+                             int n, struct teensy_request *mine)
+{
+        struct usb_teensy *dev = out->dev;
+        struct teensy_request *req, *tmp;
+        unsigned long flags;
+        LIST_HEAD(pending);
+        int ret, i;
+
+        DPRINT("teensy_submit_out(): %d requests in this report\n", n);
+        if ((ret = usb_submit_urb(out->urb, GFP_ATOMIC)) == 0)
+                return 0;
+
+        printk(KERN_ERR "teensy: usb_submit_urb() failed on out urb: %d\n", ret);
+
+        spin_lock_irqsave(&dev->out_lock, flags);
+        list_add_tail(&out->list, &dev->out_free);
+        dev->out_busy--;
+        list_splice_init(&dev->out_pending, &pending);
+        spin_unlock_irqrestore(&dev->out_lock, flags);
+
+        for (i = 0; i < n; ++i)
+                teensy_fail_request(batch[i], mine);
+        list_for_each_entry_safe(req, tmp, &pending, list) {
+                list_del(&req->list);
+                teensy_fail_request(req, mine);
+        }
+        return ret;
+}
+
+/*
+ * teensy_interrupt_out_callback
  *
- * callback function to handle data coming on from teensy
+ * callback function to handle the end of a transfer to the teensy:
+ * the out urb is reused straight away for a batch of the requests
+ * that queued up while it was in flight, or goes back on the free
+ * ring if nobody is waiting
  *
  * note, this runs in interrupt context, play nice!
  *
  */
 static void teensy_interrupt_out_callback (struct urb *urb) 
 {
+        struct teensy_out *out = urb->context;
+        struct usb_teensy *dev = out->dev;
+        struct teensy_request *batch[TEENSY_MAX_BATCH];
+        unsigned long flags;
+        int n;
+
         DPRINT("interrupt_out callback called\n");
-        usb_free_urb(urb);
+
+        switch (urb->status) {
+        case 0:
+                break;
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+                /* we're being killed, don't reuse the urb */
+                return;
+        default:
+                printk(KERN_ERR "teensy: output callback nonzero status received: %d\n",
+                       urb->status);
+                break;
+        }
+
+        spin_lock_irqsave(&dev->out_lock, flags);
+        n = teensy_fill_out(dev, out, batch);
+        if (!n) {
+                list_add_tail(&out->list, &dev->out_free);
+                dev->out_busy--;
+        }
+        spin_unlock_irqrestore(&dev->out_lock, flags);
+
+        if (n)
+                teensy_submit_out(out, batch, n, NULL);
+}
+
+/*
+ * init_writers
+ *
+ * this function sets up the ring of out URBs, each with its own
+ * DMA-coherent buffer, which are recycled by the out callback rather
+ * than allocated and mapped for every message. The size of the ring
+ * also caps the number of writes in flight. Once out_inflight of them
+ * are busy, new requests wait on out_pending and are batched into the
+ * next urb that comes back.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int init_writers (struct usb_teensy *dev)
+{
+        struct teensy_out *out;
+        int i;
+
+        spin_lock_init(&dev->out_lock);
+        INIT_LIST_HEAD(&dev->out_free);
+        INIT_LIST_HEAD(&dev->out_pending);
+        dev->out_busy = 0;
+        dev->out_inflight = clamp_t(int, out_inflight, 1, TEENSY_NUM_OUT_URBS);
+
+        for (i = 0; i < TEENSY_NUM_OUT_URBS; ++i) {
+                out = &dev->outs[i];
+                out->dev = dev;
+                out->urb = usb_alloc_urb(0, GFP_KERNEL);
+                if (!out->urb)
+                        return -ENOMEM;
+                out->buf = usb_buffer_alloc(dev->udev, RAWHID_RX_SIZE,
+                                            GFP_KERNEL, &out->dma);
+                if (!out->buf)
+                        return -ENOMEM;
+
+                usb_fill_int_urb (out->urb,
+                                  dev->udev,
+                                  usb_sndintpipe(dev->udev,
+                                                 dev->out_endpoint),
+                                  out->buf,
+                                  RAWHID_RX_SIZE,
+                                  teensy_interrupt_out_callback, out,
+                                  dev->out_interval);
+                out->urb->transfer_dma = out->dma;
+                out->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+                list_add_tail(&out->list, &dev->out_free);
+        }
+        return 0;
+}
+
+/* kill and free the ring of out URBs; safe on a partly built ring */
+static void exit_writers (struct usb_teensy *dev)
+{
+        struct teensy_out *out;
+        int i;
+
+        for (i = 0; i < TEENSY_NUM_OUT_URBS; ++i) {
+                out = &dev->outs[i];
+                if (out->urb) {
+                        usb_kill_urb(out->urb);
+                        usb_free_urb(out->urb);
+                        out->urb = NULL;
+                }
+                if (out->buf) {
+                        usb_buffer_free(dev->udev, RAWHID_RX_SIZE,
+                                        out->buf, out->dma);
+                        out->buf = NULL;
+                }
+        }
 }
 
 /*
  * init_reader
  *
- * this function sets up the reader URB and submits it
- * this enables interrupt driven reading of any packets from teensy
+ * this function sets up the ring of reader URBs and submits them
+ * this enables interrupt driven reading of any packets from teensy.
+ * Keeping several URBs queued means the host can take another report
+ * while the callback for the last one is still running. The reports
+ * themselves are dealt with by in_work, on a workqueue of our own.
  *
  * struct usb_interface *intf  -- the interface to read from
  *
+ * @return: < 0 on failure; 0 o/w
  */
-void init_reader (struct usb_interface *intf) 
+int init_reader (struct usb_interface *intf) 
 {
 
         struct usb_teensy *dev = usb_get_intfdata(intf);
+        struct urb *urb;
+        unsigned char *buf;
+        int i, ret;
+
+        dev->in_head = dev->in_tail = 0;
+        INIT_WORK(&dev->in_work, teensy_in_work);
+        dev->in_wq = create_singlethread_workqueue("teensy_in");
+        if (!dev->in_wq)
+                return -ENOMEM;
 
-        dev->in_urb = usb_alloc_urb(0, GFP_KERNEL);
+        dev->num_in_urbs = clamp_t(int, in_urbs, 1, TEENSY_MAX_IN_URBS);
+
+        for (i = 0; i < dev->num_in_urbs; ++i) {
+                urb = usb_alloc_urb(0, GFP_KERNEL);
+                if (!urb)
+                        return -ENOMEM;
+                dev->in_urbs[i] = urb;
+
+                buf = usb_buffer_alloc(dev->udev, dev->in_size, GFP_KERNEL,
+                                       &urb->transfer_dma);
+                if (!buf)
+                        return -ENOMEM;
+
+                usb_fill_int_urb (urb,
+                                  dev->udev,
+                                  usb_rcvintpipe(dev->udev,
+                                                 dev->in_endpoint),
+                                  buf,
+                                  dev->in_size,
+                                  teensy_interrupt_in_callback, dev,
+                                  dev->in_interval);
+                urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+                if ((ret = usb_submit_urb(urb, GFP_KERNEL)) < 0)
+                        return ret;
+        }
 
-        usb_fill_int_urb (dev->in_urb,
-                          dev->udev,
-                          usb_rcvintpipe(dev->udev,
-                                         dev->in_endpoint),
-                          dev->in_buf,
-                          dev->in_size,
-                          teensy_interrupt_in_callback, dev,
-                          dev->in_interval);
+        DPRINT("%d in URBs submitted\n", dev->num_in_urbs);
+        return 0;
+}
 
-        usb_submit_urb(dev->in_urb, GFP_KERNEL);
+/* kill and free the ring of in URBs, then let in_work finish with
+ * what they left in the in ring; safe on a partly built ring */
+static void exit_reader (struct usb_teensy *dev)
+{
+        struct urb *urb;
+        int i;
+
+        /* kill our URBs synchronously... kill them DEAD */
+        for (i = 0; i < TEENSY_MAX_IN_URBS; ++i) {
+                urb = dev->in_urbs[i];
+                if (!urb)
+                        continue;
+                usb_kill_urb(urb);
+                if (urb->transfer_buffer)
+                        usb_buffer_free(dev->udev, dev->in_size,
+                                        urb->transfer_buffer, urb->transfer_dma);
+                usb_free_urb(urb);
+                dev->in_urbs[i] = NULL;
+        }
 
-        DPRINT("in URB submitted\n");
+        if (dev->in_wq) {
+                destroy_workqueue(dev->in_wq); /* flushes in_work */
+                dev->in_wq = NULL;
+        }
 }
 
 /*
- * teensy_send
+ * sysfs statistics for the in urbs: reports received, reports that
+ * matched no sender and were dropped, replies that found another
+ * request in their slot, urbs that completed with an error, reports
+ * lost to a full in ring, and the longest in callback in nanoseconds
+ */
+static ssize_t show_in_received(struct device *d, struct device_attribute *attr,
+                                char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%d\n", atomic_read(&dev->in_received));
+}
+static DEVICE_ATTR(in_received, S_IRUGO, show_in_received, NULL);
+
+static ssize_t show_in_dropped(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%d\n", atomic_read(&dev->in_dropped));
+}
+static DEVICE_ATTR(in_dropped, S_IRUGO, show_in_dropped, NULL);
+
+static ssize_t show_in_collisions(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%d\n", atomic_read(&dev->in_collisions));
+}
+static DEVICE_ATTR(in_collisions, S_IRUGO, show_in_collisions, NULL);
+
+static ssize_t show_in_errors(struct device *d, struct device_attribute *attr,
+                              char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%d\n", atomic_read(&dev->in_errors));
+}
+static DEVICE_ATTR(in_errors, S_IRUGO, show_in_errors, NULL);
+
+static ssize_t show_in_overruns(struct device *d, struct device_attribute *attr,
+                                char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%d\n", atomic_read(&dev->in_overruns));
+}
+static DEVICE_ATTR(in_overruns, S_IRUGO, show_in_overruns, NULL);
+
+static ssize_t show_in_irq_max_ns(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+{
+        struct usb_teensy *dev = usb_get_intfdata(to_usb_interface(d));
+        return sprintf(buf, "%lld\n", (long long)dev->in_irq_max_ns);
+}
+static DEVICE_ATTR(in_irq_max_ns, S_IRUGO, show_in_irq_max_ns, NULL);
+
+static struct attribute *teensy_attrs[] = {
+        &dev_attr_in_received.attr,
+        &dev_attr_in_dropped.attr,
+        &dev_attr_in_collisions.attr,
+        &dev_attr_in_errors.attr,
+        &dev_attr_in_overruns.attr,
+        &dev_attr_in_irq_max_ns.attr,
+        NULL,
+};
+
+static struct attribute_group teensy_attr_group = {
+        .attrs = teensy_attrs,
+};
+
+/*
+ * teensy_send_async
  *
- * this function takes a teensy_request from a client, and cues it on
- * the senders_list for servicing by the reader callback routine
+ * this function takes a teensy_request from a client, cues it in the
+ * senders_table for servicing by the reader callback routine, sends
+ * it to the teensy and returns at once. When the reply arrives, req
+ * is unpacked and @callback(req) is called; req->status is < 0 if the
+ * reply could not be delivered. Several requests can be in flight at
+ * once, may share a report with other requests, and may well be
+ * answered out of order.
  *
- * a submission here will block, but waking is probably
- * non-deterministic. If there are multiple reads queued for the same
- * teensy device, it is very possible that they will be serviced out
- * of order.
- * 
- * @req: req->buf must be kfree()able pointer; caller is expected to
- * free req->buf after return; req->buf WILL NOT be the same pointer
- * as was passed! req->buf and req->size are modified and contain the
- * result on return.
- * 
- * NOTE: if you have a zero byte payload, then do req->buf =
- * kmalloc(0,...): this gives a free()able pointer.
+ * The callback runs from the driver's workqueue when the reply comes
+ * in, but from interrupt context if the request fails to go out, so
+ * it must not sleep either way. It owns req from then on and may
+ * teensy_free_request() it.
+ *
+ * INTERRUPT MODE SAFE
+ *
+ * @req: must come from teensy_alloc_request(). The payload in
+ * req->buf is framed in place, and on callback req->buf and req->size
+ * contain the reply payload.
+ *
+ * @context: stored in req->context for the callback
+ *
+ * If the teensy is unplugged first, the callback gets req->status
+ * -ENODEV.
+ *
+ * @return: < 0 if the request could not be sent, -ENODEV if there is
+ * no teensy, in which case the callback will not be called; 0 o/w
  */
-int teensy_send(struct teensy_request *req)
+int teensy_send_async(struct teensy_request *req, teensy_callback_t callback,
+                      void *context)
 {
-        int ret;
-        struct usb_teensy * dev = teensy_dev;
-        struct urb * out_urb;
+        int ret = 0, i, n = 0;
+        unsigned long flags;
+        struct usb_teensy * dev;
+        struct teensy_out * out = NULL;
+        struct teensy_request *batch[TEENSY_MAX_BATCH];
         
-        DPRINT("teensy_send()\n");
+        DPRINT("teensy_send_async()\n");
         /* check the request for validity (no nullptrs etc) */
         /* set request completed to FALSE */
 
-        if (!req) {
-                printk(KERN_ERR "teensy_send(): NULL req, bailing\n");
+        if (!req || !callback) {
+                printk(KERN_ERR "teensy_send_async(): NULL req or callback, bailing\n");
                 return -EINVAL;
         }
         /*
@@ -344,68 +951,199 @@ int teensy_send(struct teensy_request *req)
           return -EINVAL;
           }
         */
-        if (!dev) {
-                DPRINT("teensy_send(): NULL dev, bailing\n");
-                return -EINVAL;
-        }
-
-
-        /* complete the setup of the request */
-        spin_lock(&pkt_id_lock);
-        req->packet_id = pkt_id++;     /* we let overflow just happen.... */
-        spin_unlock(&pkt_id_lock);
 
         req->complete = false;
+        req->status = 0;
+        req->callback = callback;
+        req->context = context;
 
-        DPRINT("req size: %zu, packet_id: %c, buffer add: %p\n", req->size, req->packet_id, req->buf);
-
-        /* LOCK the LIST!! */
-        spin_lock(&senders_lock);
+        /* LOCK the TABLE!! */
+        spin_lock_irqsave(&senders_lock, flags);
 
         DPRINT ("got reader lock\n");
+
+        /* no device, or not the one req came from: it's been
+         * unplugged. Counting ourselves in senders keeps
+         * disconnect_teensy() from failing the table under us */
+        dev = teensy_dev;
+        if (!dev || dev != req->dev) {
+                spin_unlock_irqrestore(&senders_lock, flags);
+                DPRINT("teensy_send_async(): no device, bailing\n");
+                return -ENODEV;
+        }
+        atomic_inc(&dev->senders);
         
-        /* put the request on the tail of the list */
-        list_add_tail(&req->list, &senders_list); 
+        /* complete the setup of the request: we let pkt_id overflow
+         * just happen, but skip over ids whose slot is still waiting
+         * on a reply; unpack() checks the full id, so a stray packet
+         * can't complete the wrong request. Nothing times a slot out,
+         * so with every one waiting we give up with -EBUSY */
+        for (i = 0; i <= TEENSY_MAX_INFLIGHT &&
+                     (senders_table[TEENSY_SLOT(pkt_id)] || pkt_id == TEENSY_STREAM_ID); ++i)
+                pkt_id++;
+        if (senders_table[TEENSY_SLOT(pkt_id)] || pkt_id == TEENSY_STREAM_ID) {
+                spin_unlock_irqrestore(&senders_lock, flags);
+                printk(KERN_ERR "teensy_send_async(): all packet ids in use\n");
+                ret = -EBUSY;
+                goto out;
+        }
+        req->packet_id = pkt_id++;
+
+        /* put the request in its slot */
+        senders_table[TEENSY_SLOT(req->packet_id)] = req;
 
-        /* UNLOCK THE LIST!! */
-        spin_unlock(&senders_lock);
+        /* UNLOCK THE TABLE!! */
+        spin_unlock_irqrestore(&senders_lock, flags);
+
+        DPRINT("req size: %zu, packet_id: %u, buffer add: %p\n", req->size, req->packet_id, req->buf);
         
         /* send packet to teensy */
-        /* TODO -- right now teensy just sends data on its own, need
-         * to implement a protocol for requesting the right kind of
-         * data */
 
         if ((ret = pack(req)) < 0) {
-                printk(KERN_ERR "teensy_send(): pack() failed\n");
-                return ret;
+                printk(KERN_ERR "teensy_send_async(): pack() failed\n");
+                teensy_forget_request(req);
+                goto out;
+        }
+
+        /* get in line; if fewer than out_inflight urbs are busy,
+         * grab an idle one and send everything in line right away,
+         * otherwise the out callback will batch us with whoever else
+         * queues up before an urb comes back */
+        spin_lock_irqsave(&dev->out_lock, flags);
+        list_add_tail(&req->list, &dev->out_pending);
+        if (dev->out_busy < dev->out_inflight && !list_empty(&dev->out_free)) {
+                out = list_entry(dev->out_free.next, struct teensy_out, list);
+                list_del(&out->list);
+                dev->out_busy++;
+                n = teensy_fill_out(dev, out, batch);
+        }
+        spin_unlock_irqrestore(&dev->out_lock, flags);
+
+        if (out)
+                ret = teensy_submit_out(out, batch, n, req);
+out:
+        if (atomic_dec_and_test(&dev->senders))
+                wake_up(&dev->senders_wait);
+        return ret < 0 ? ret : 0;
+}
+EXPORT_SYMBOL(teensy_send_async);
+
+/* teensy_send()'s callback: wake the sleeping sender */
+static void teensy_send_complete(struct teensy_request *req)
+{
+        complete(&req->done);
+}
+
+/*
+ * teensy_send
+ *
+ * the blocking version of teensy_send_async(): a submission here will
+ * block until the reply for this request arrives; each request
+ * carries its own completion, so a reply wakes only the sender it
+ * belongs to. If there are multiple reads queued for the same teensy
+ * device, it is very possible that they will be serviced out of
+ * order.
+ * 
+ * @req: must come from teensy_alloc_request(); caller is expected to
+ * teensy_free_request() it after return. The payload in req->buf is
+ * framed in place, and on return req->buf and req->size contain the
+ * reply payload.
+ *
+ * @return: the size of the reply, or < 0 on failure
+ */
+int teensy_send(struct teensy_request *req)
+{
+        int ret;
+
+        DPRINT("teensy_send()\n");
+
+        if (!req) {
+                printk(KERN_ERR "teensy_send(): NULL req, bailing\n");
+                return -EINVAL;
         }
-        DPRINT("teensy_send(): 1 \n");
-        out_urb = usb_alloc_urb(0, GFP_KERNEL);
-        DPRINT("teensy_send(): 2 \n");
-        usb_fill_int_urb (out_urb,
-                          dev->udev,
-                          usb_sndintpipe(dev->udev,
-                                         dev->out_endpoint),
-
-                          req->buf,
-                          req->size,
-
-                          teensy_interrupt_out_callback, dev,
-                          dev->out_interval);
-        DPRINT("teensy_send(): 3 \n");
-        usb_submit_urb(out_urb, GFP_KERNEL);
-        DPRINT("teensy_send(): 4 \n");      
-        /* wait_event completed == TRUE */
-        wait_event(senders_queue, (req->complete));
-        DPRINT("teensy_send(): 5 \n");
-        /* back from blocked read, get the hell off the readers list
-         * because we'll be freed soon...*/
-        spin_lock(&senders_lock);
-        list_del(&req->list);
-        spin_unlock(&senders_lock);
+
+        init_completion(&req->done);
+
+        if ((ret = teensy_send_async(req, teensy_send_complete, NULL)) < 0)
+                return ret;
+
+        /* sleep until the in callback completes this request; it has
+         * already taken us out of the table */
+        wait_for_completion(&req->done);
+
+        if (req->status < 0)
+                return req->status;
 
         return req->size;
 }
+EXPORT_SYMBOL(teensy_send);
+
+/*
+ * teensy_register_stream
+ *
+ * have @handler called with the payload of every frame the teensy
+ * sends on its own (packet id TEENSY_STREAM_ID) for @destination.
+ * Call from a submodule's init, before the in urbs start.
+ *
+ * @return: -EBUSY if @destination is taken; 0 o/w
+ */
+int teensy_register_stream(unsigned char destination, teensy_stream_t handler)
+{
+        if (stream_handlers[destination])
+                return -EBUSY;
+        stream_handlers[destination] = handler;
+        return 0;
+}
+EXPORT_SYMBOL(teensy_register_stream);
+
+/* undo teensy_register_stream(); call from a submodule's exit */
+void teensy_unregister_stream(unsigned char destination)
+{
+        stream_handlers[destination] = NULL;
+}
+EXPORT_SYMBOL(teensy_unregister_stream);
+
+/*
+ * teensy_fail_all
+ *
+ * the teensy is gone: call back every request still waiting on it,
+ * queued or sent, with @status, so nobody waits for a reply forever.
+ * Call once teensy_dev is cleared and no sender is under way, so
+ * nothing new can join the table or out_pending, and with the in and
+ * out urbs dead, so no reply or failed resubmit races us.
+ */
+static void teensy_fail_all(struct usb_teensy *dev, int status)
+{
+        struct teensy_request *req, *tmp;
+        unsigned long flags;
+        LIST_HEAD(failed);
+        int i;
+
+        /* everything in out_pending is in the table too; unlink it so
+         * the out callback can't batch it once it's been freed */
+        spin_lock_irqsave(&dev->out_lock, flags);
+        list_for_each_entry_safe(req, tmp, &dev->out_pending, list)
+                list_del_init(&req->list);
+        spin_unlock_irqrestore(&dev->out_lock, flags);
+
+        spin_lock_irqsave(&senders_lock, flags);
+        for (i = 0; i < TEENSY_MAX_INFLIGHT; ++i) {
+                req = senders_table[i];
+                if (!req)
+                        continue;
+                senders_table[i] = NULL;
+                req->complete = true;
+                list_add_tail(&req->list, &failed);
+        }
+        spin_unlock_irqrestore(&senders_lock, flags);
+
+        list_for_each_entry_safe(req, tmp, &failed, list) {
+                list_del_init(&req->list);
+                req->status = status;
+                req->size = 0;
+                req->callback(req);
+        }
+}
 
 static int probe_teensy (struct usb_interface *intf,
                          const struct usb_device_id *id) 
@@ -413,19 +1151,23 @@ static int probe_teensy (struct usb_interface *intf,
         struct usb_teensy * dev;
         struct usb_host_interface *iface_desc;
         struct usb_endpoint_descriptor *endpoint;
+        unsigned long flags;
         int i, result;
                 
         DPRINT("connect detected\n");
 
-        /* allocate for our device structure */
-        teensy_dev = kmalloc(sizeof(struct usb_teensy), GFP_KERNEL);
-        dev = teensy_dev;
+        /* allocate for our device structure; it isn't teensy_dev
+         * until it's ready to take requests */
+        dev = kmalloc(sizeof(struct usb_teensy), GFP_KERNEL);
         if(!dev) {
                 printk(KERN_ERR "teensy: failed to allocate device memory!\n");
                 return -ENOMEM;
         }
 
         memset(dev, 0x00, sizeof(*dev));
+        kref_init(&dev->kref);
+        atomic_set(&dev->senders, 0);
+        init_waitqueue_head(&dev->senders_wait);
 
         /* connect the device and interface to our dev structure */
         dev->udev = usb_get_dev(interface_to_usbdev(intf));
@@ -454,19 +1196,11 @@ static int probe_teensy (struct usb_interface *intf,
                         dev->in_endpoint = endpoint->bEndpointAddress;
                         dev->in_size = endpoint->wMaxPacketSize;
                         dev->in_interval = endpoint->bInterval;
-                        dev->in_buf = kmalloc(dev->in_size, GFP_KERNEL);
 
                         DPRINT("--IN endpoint: %d, size: %zu, interval: %d\n",
                                dev->in_endpoint,
                                dev->in_size,
                                dev->in_interval);
-                        
-
-                        if (!dev->in_buf) {
-                                kfree(dev);
-                                printk(KERN_ERR "teensy: failed to allocate buffer!\n");
-                                return -ENOMEM;
-                        }
                                         
                 }
 
@@ -489,12 +1223,17 @@ static int probe_teensy (struct usb_interface *intf,
 
         if (!(dev->in_endpoint && dev->out_endpoint)) {
                 printk(KERN_ERR "teensy: Failed to find both in and out endpoints\n");
-                if (!dev->in_buf) {
-                        kfree(dev->in_buf);
-                }
-                if(!dev) {
-                        kfree(dev);
-                }
+                usb_put_dev(dev->udev);
+                kfree(dev);
+                return -ENOMEM;
+        }
+
+        if (init_pools(dev) || init_writers(dev)) {
+                printk(KERN_ERR "teensy: failed to allocate request pool or out urbs!\n");
+                exit_writers(dev);
+                exit_pools(dev);
+                usb_put_dev(dev->udev);
+                kfree(dev);
                 return -ENOMEM;
         }
 
@@ -503,11 +1242,12 @@ static int probe_teensy (struct usb_interface *intf,
         /* save the data pointer in the interface */
         usb_set_intfdata (intf, dev);
 
-        /* additional setup stuff */
-        spin_lock_init (&senders_lock);
-        init_waitqueue_head(&senders_queue);
+        /* additional setup stuff: open for requests */
+        spin_lock_irqsave(&senders_lock, flags);
         pkt_id = 0;
-        spin_lock_init (&pkt_id_lock);
+        memset(senders_table, 0x00, sizeof(senders_table));
+        teensy_dev = dev;
+        spin_unlock_irqrestore(&senders_lock, flags);
         
         
         /* sub-module-specific init */
@@ -515,8 +1255,12 @@ static int probe_teensy (struct usb_interface *intf,
         if (result)
                 printk(KERN_ERR "teensy: failed to load adc");
 
+        if (sysfs_create_group(&intf->dev.kobj, &teensy_attr_group))
+                printk(KERN_ERR "teensy: failed to create sysfs statistics\n");
+
         /* now start our interrupt driven reader... all other setup is done */
-        init_reader(intf);
+        if ((result = init_reader(intf)) < 0)
+                printk(KERN_ERR "teensy: failed to start in urbs: %d\n", result);
         
 
         return 0; /* TODO, really? */
@@ -526,6 +1270,7 @@ static int probe_teensy (struct usb_interface *intf,
 static void disconnect_teensy(struct usb_interface *intf) 
 {
         struct usb_teensy *dev;
+        unsigned long flags;
         
         DPRINT("disconnect detected\n");
 
@@ -533,22 +1278,31 @@ static void disconnect_teensy(struct usb_interface *intf)
                 
         if(dev) {
 
-                /* kill our URB synchronously... kill it DEAD */
-                if(dev->in_urb) {
-                        usb_kill_urb(dev->in_urb);
-                        usb_free_urb(dev->in_urb);
-                }
-                
-                if(dev->in_buf) {
-                        kfree(dev->in_buf);
-                }
+                sysfs_remove_group(&intf->dev.kobj, &teensy_attr_group);
 
-                kfree(dev);
+                /* closed for new requests: they get -ENODEV, and
+                 * nobody gets dev from teensy_dev any more */
+                spin_lock_irqsave(&senders_lock, flags);
+                teensy_dev = NULL;
+                spin_unlock_irqrestore(&senders_lock, flags);
+                wait_event(dev->senders_wait, !atomic_read(&dev->senders));
 
-        }
+                /* nothing can be sent any more; once the urbs are
+                 * dead, every request left is ours to fail */
+                exit_reader(dev);
+                exit_writers(dev);
+                teensy_fail_all(dev, -ENODEV);
 
-        /* sub-module-specific cleanup */
-        exit_submodules();
+                /* sub-module-specific cleanup, while dev is whole:
+                 * anything they still send fails, and what they
+                 * free goes back to dev's pool */
+                exit_submodules();
+
+                /* requests still out hold dev until they're freed */
+                usb_set_intfdata(intf, NULL);
+                kref_put(&dev->kref, teensy_release_dev);
+
+        }
 
         DPRINT("completed disconnect\n");
         
@@ -569,10 +1323,20 @@ teensy_init(void)
         
         DPRINT("initializing...\n");
 
+        /* request slab, carved up per device at probe */
+        teensy_req_cache = kmem_cache_create("teensy_request",
+                                             sizeof(struct teensy_request),
+                                             0, SLAB_HWCACHE_ALIGN, NULL);
+        if (!teensy_req_cache) {
+                printk(KERN_ERR "teensy: failed to create slab cache!\n");
+                return -ENOMEM;
+        }
+
         /* generic init */
         result = usb_register (&teensy_driver);
         if (result) {
                 printk(KERN_ERR "teensy: failed to register usb device! error code: %d", result);
+                kmem_cache_destroy(teensy_req_cache);
         } else {                
                 DPRINT("initialized.\n");
         }
@@ -605,6 +1369,7 @@ teensy_exit(void)
 
         /* generic cleanup */
         usb_deregister(&teensy_driver);
+        kmem_cache_destroy(teensy_req_cache);
         
         DPRINT("removal complete.\n");
 }
@@ -31,6 +31,13 @@
 #include <linux/moduleparam.h>
 #include <linux/usb.h>
 #include <linux/device.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
 
 #define TEENSY_DEBUG 
 
@@ -40,6 +47,45 @@
 /* MUST BE THE SAME AS IN ../lighty_usb_teensy/usb_rawhid.c */
 #define RAWHID_RX_SIZE 64 /* usb buffer packet size */
 
+/* every frame is [packet_id lo][packet_id hi][size][payload][padding];
+ * a report may hold several [packet_id lo][packet_id hi][size][payload]
+ * sub-frames back to back, ended by a zero size or the end of the
+ * report */
+#define TEENSY_HDR_SIZE 3
+#define TEENSY_MAX_PAYLOAD (RAWHID_RX_SIZE - TEENSY_HDR_SIZE)
+
+/* slots in the senders table, and so the most requests awaiting a
+ * reply at once; a power of two well below the 65536 16-bit packet
+ * ids, so an id isn't reused until long after its slot was */
+#define TEENSY_MAX_INFLIGHT 1024
+
+/* packet id of the frames the teensy sends on its own, e.g. adc
+ * samples; never handed out to a request. The first payload byte of
+ * such a frame picks the stream handler, see teensy_register_stream() */
+#define TEENSY_STREAM_ID 0xffff
+
+/* requests preallocated per device; the pools grow past this on demand */
+#define TEENSY_POOL_SIZE 32
+
+/* out urbs per device; caps the number of writes in flight */
+#define TEENSY_NUM_OUT_URBS 8
+
+/* out urbs in flight before new requests are batched; see the
+ * out_inflight module parameter */
+#define TEENSY_DEFAULT_OUT_INFLIGHT 2
+
+/* most sub-frames one report can carry: each is a header plus at
+ * least one byte of payload */
+#define TEENSY_MAX_BATCH (RAWHID_RX_SIZE / (TEENSY_HDR_SIZE + 1))
+
+/* in urbs kept queued per device; see the in_urbs module parameter */
+#define TEENSY_DEFAULT_IN_URBS 4
+#define TEENSY_MAX_IN_URBS 16
+
+/* reports buffered between the in callback and the in worker; a
+ * power of two */
+#define TEENSY_IN_RING 64
+
 /* a debug printk */
 #ifdef TEENSY_DEBUG
 #define DPRINT(msg...)  printk(KERN_DEBUG "teensy: " msg)
@@ -60,16 +106,56 @@ MODULE_LICENSE("GPL");
  * 
  */
 
+struct usb_teensy;
+
+/* one raw report in the in ring */
+struct teensy_in_slot {
+        size_t len;                       /* bytes received */
+        ktime_t received;                 /* when the urb completed */
+        unsigned char data[RAWHID_RX_SIZE]; /* the report, as received */
+};
+
+/* one out urb of the per-device ring, with its DMA-coherent buffer */
+struct teensy_out {
+        struct list_head list;            /* free ring linkage */
+        struct usb_teensy *dev;           /* the device we belong to */
+        struct urb *urb;                  /* the urb, filled once at probe */
+        unsigned char *buf;               /* RAWHID_RX_SIZE transfer buffer */
+        dma_addr_t dma;                   /* dma address of buf */
+};
+
 struct usb_teensy {
+        struct kref kref;                 /* held by probe and every request out of the pool */
+        atomic_t senders;                 /* teensy_send_async() calls under way */
+        wait_queue_head_t senders_wait;   /* woken when the last one is done */
         struct usb_device *udev;          /* the usb device for this device */
         struct usb_interface *interface;  /* the interface for this device */
-        unsigned char *in_buf;            /* the buffer for receiving data */
-        size_t in_size;                   /* the size of the buffer */
+        size_t in_size;                   /* the size of each in buffer */
         __u8 in_endpoint;                 /* the device endpoint for incoming packets */
         __u8 out_endpoint;                /* the device endpoint for outgoing packets */
-        struct urb *in_urb;               /* our input urb */
+        struct urb *in_urbs[TEENSY_MAX_IN_URBS]; /* our input urbs, each with its own buffer */
+        int num_in_urbs;                  /* how many of in_urbs are in use */
+        atomic_t in_received;             /* reports received */
+        atomic_t in_dropped;              /* reports nobody was waiting for */
+        atomic_t in_collisions;           /* replies whose slot holds another id */
+        atomic_t in_errors;               /* in urbs completed with an error */
+        atomic_t in_overruns;             /* reports lost to a full in ring */
+        s64 in_irq_max_ns;                /* longest in callback so far */
+        struct teensy_in_slot in_ring[TEENSY_IN_RING]; /* reports for in_work */
+        unsigned int in_head;             /* next slot the in callback fills */
+        unsigned int in_tail;             /* next slot in_work empties */
+        struct workqueue_struct *in_wq;   /* runs in_work */
+        struct work_struct in_work;       /* demuxes the in ring to senders */
         int in_interval;                  /* the polling interval of the input endpoint */
         int out_interval;                 /* the polling interval of the output endpoint */
+        spinlock_t pool_lock;             /* protects the free lists */
+        struct list_head free_reqs;       /* pool of teensy_requests */
+        spinlock_t out_lock;              /* protects out_free and out_pending */
+        struct list_head out_free;        /* idle out urbs */
+        struct list_head out_pending;     /* requests waiting to be batched into an out urb */
+        int out_busy;                     /* out urbs in flight */
+        int out_inflight;                 /* out_busy limit before we batch */
+        struct teensy_out outs[TEENSY_NUM_OUT_URBS]; /* the out urb ring */
 };
 
 /* 
@@ -82,16 +168,47 @@ struct usb_teensy {
  *   address of a buffer to be filled and the size paramater with the size
  *   of the buffer (or of the data desired, less than buffer size,
  *   obviously). Ignore the other fields, they're used internally.
+ *
+ * Requests now come from teensy_alloc_request(), which hands out a
+ * pooled request whose *buf points at the payload slot of its own
+ * frame. Write at most TEENSY_MAX_PAYLOAD bytes into *buf, set size,
+ * teensy_send() it, and teensy_free_request() it when you're done
+ * with the reply, which comes back in the same *buf.
+ *
+ * To keep several requests in flight, use teensy_send_async()
+ * instead; it returns at once and calls back when the reply is in.
+ * Replies are handed out from the driver's workqueue, not from the
+ * urb callback, but a request that fails to go out may be called back
+ * from interrupt context, so callbacks must not sleep.
  */
+struct teensy_request;
+typedef void (*teensy_callback_t)(struct teensy_request *);
+
 struct teensy_request {
 
-        struct list_head list; /* we're a linked list */
-        char packet_id;        /* packet id for this request */
-        char *buf;             /* buffer to store the read data in */
+        struct list_head list; /* free list or out_pending linkage */
+        struct usb_teensy *dev; /* the device whose pool we came from */
+        uint16_t packet_id;    /* packet id for this request */
+        char *buf;             /* payload: points into frame */
         size_t size;           /* the size of the request */
         bool complete;         /* the status of the request */
-        
+        struct completion done; /* signalled when the reply arrives (teensy_send()) */
+        teensy_callback_t callback; /* called when the reply arrives */
+        void *context;         /* for the callback's use */
+        int status;            /* < 0 if the reply could not be delivered */
+        char frame[RAWHID_RX_SIZE]; /* the outgoing report, framed in place */
+
 };
+struct teensy_request * teensy_alloc_request(gfp_t);
+void teensy_free_request(struct teensy_request *);
+int teensy_send_async(struct teensy_request *, teensy_callback_t, void *);
 int teensy_send(struct teensy_request *);
 
+/* called from the driver's workqueue with the payload of each stream
+ * frame for its destination, less the destination byte, and the time
+ * its urb completed */
+typedef void (*teensy_stream_t)(const unsigned char *, size_t, ktime_t);
+int teensy_register_stream(unsigned char destination, teensy_stream_t);
+void teensy_unregister_stream(unsigned char destination);
+
 #endif /* TEENSY_H */
@@ -38,6 +38,9 @@
 #include <linux/wait.h>       /* sleep */
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>   /* large proc read() */
+#include <linux/poll.h>
+#include <linux/vmalloc.h>    /* vmalloc_user() */
+#include <linux/mm.h>         /* remap_vmalloc_range() */
 
 #include "teensy_adc.h"
 #include "teensy.h"
@@ -51,17 +54,108 @@ MODULE_LICENSE("GPL");
 #define DEVICE_NAME "adc"
 #define ADC_NUM_DEVS 6
 
+/* samples or records buffered per unit while streaming; powers of
+ * two */
+#define ADC_RING_SAMPLES 4096
+#define ADC_SAMPLE_SIZE 2
+#define ADC_BYTE_SAMPLE_SIZE 1
+#define ADC_STREAM_FLAGS (ADC_STREAM_RECORDS | ADC_STREAM_8BIT | ADC_STREAM_PACKED)
+#define ADC_RING_RECORDS 1024
+#define ADC_RECORD_SIZE sizeof(struct adc_record)
+#define ADC_RING_DATA_SIZE max(ADC_RING_SAMPLES * ADC_SAMPLE_SIZE, \
+                               ADC_RING_RECORDS * ADC_RECORD_SIZE)
+
+/* the unit byte of a scan request; see handle_adc() in
+ * ../teensy_usb_hw/teensyHW2USB.c */
+#define ADC_SCAN_UNIT 0x80
+
+/* ... and of capture requests, to arm and to cancel */
+#define ADC_CAPTURE_UNIT 0x81
+#define ADC_CANCEL_UNIT 0x82
+
+/* ... and of block reads, to start and to stop */
+#define ADC_BLOCK_UNIT 0x83
+#define ADC_UNBLOCK_UNIT 0x84
+
+/* a unit's sample ring: a header page (struct adc_ring_header) with
+ * the samples after it, in one vmalloc_user() area that mmap() hands
+ * to userland as is. The ring is filled by adc_stream_handler() and
+ * drained by read() or a userland mapping; the stream handler is the
+ * only producer and there's only one consumer at a time, so head and
+ * tail need no lock, just barriers. Each mapping, and each reader or
+ * waiter while it's at it, holds a reference, so a ring outlives the
+ * unplug of its teensy while it's in use; see adc_ring_get(). */
+#define ADC_RING_MAP_SIZE (PAGE_SIZE + PAGE_ALIGN(ADC_RING_DATA_SIZE))
+
+struct adc_ring {
+        atomic_t refs;
+        void * map;                       /* header page, then samples */
+        struct adc_ring_header * hdr;     /* head, tail, ... in map */
+        unsigned char * data;             /* samples in map */
+        unsigned int size;                /* elements in the ring */
+        size_t elem_size;                 /* bytes per element */
+};
+
 static struct adc_dev_t {
         struct cdev cdev;
+        struct adc_ring * ring;     /* streamed samples, NULL once gone */
+        bool gone;                  /* its teensy was unplugged */
+        struct mutex read_mutex;    /* one reader drains the ring at a time */
+        wait_queue_head_t wait;     /* readers waiting for samples */
 } adc_devs[ADC_NUM_DEVS];
 
+/* covers taking a reference to adc_devs[].ring against the unplug */
+static DEFINE_SPINLOCK(adc_ring_lock);
+
+/* stream state; stream_mutex serializes starting and stopping */
+static DEFINE_MUTEX(stream_mutex);
+static uint16_t stream_mask;        /* units streaming, 0 if none */
+static struct file * stream_owner;  /* the stream stops when it's closed */
+static uint8_t stream_seq;          /* next frame seq we expect */
+static bool stream_synced;          /* stream_seq is valid */
+static unsigned int stream_lost;    /* frames lost on the way */
+static uint32_t stream_scan;        /* last scan number, 32 bits wide */
+
+/* burst capture; the teensy has one, owned by the file that armed it.
+ * capture_mutex serializes arming, reading and cancelling;
+ * capture_lock covers what adc_capture_handler() fills in. */
+static DEFINE_MUTEX(capture_mutex);
+static DEFINE_SPINLOCK(capture_lock);
+static struct file * capture_owner; /* NULL if none */
+static unsigned int capture_unit;
+static uint8_t capture_id;          /* tells this capture's frames apart */
+static unsigned int capture_len;    /* samples in so far */
+static unsigned int capture_pos;    /* samples read() so far */
+static int capture_status;          /* 0 while coming in, 1 when in, < 0 on failure */
+static unsigned char capture_buf[ADC_CAPTURE_SAMPLES];
+
+/* block reads; the teensy does one at a time. block_mutex is held for
+ * the whole of one; block_lock covers what adc_block_handler() fills
+ * in. */
+static DEFINE_MUTEX(block_mutex);
+static DEFINE_SPINLOCK(block_lock);
+static DECLARE_WAIT_QUEUE_HEAD(block_wait);
+static unsigned char * block_buf;   /* NULL if none under way */
+static uint8_t block_id;            /* tells this block's frames apart */
+static unsigned int block_len;      /* samples in so far */
+static unsigned int block_count;    /* samples asked for */
+static int block_status;            /* 0 while coming in, 1 when in, < 0 on failure */
+
 /* to put in filp->private_data */
 /* make it a struct so i can add more fields later if needed */
 struct adc_filp_data {
 	int unit;
         struct adc_dev_t * adc;
+        struct mutex lock;                /* protects pending */
+        struct teensy_request * pending;  /* single read in flight, if any */
+        bool ready;                       /* pending has its reply */
+        wait_queue_head_t wait;           /* woken when it does */
 };
 
+/* protects ready and the pending request's context against its
+ * callback, which may outlive the file: see adc_release() */
+static DEFINE_SPINLOCK(adc_async_lock);
+
 static dev_t adc_dev_number;
 struct class * adc_class;
 
@@ -78,6 +172,798 @@ static struct adc_filp_data * _get_private_data (struct file * filp) {
         return (struct adc_filp_data *)filp->private_data;
 }
 
+static struct adc_ring * adc_ring_alloc(void) {
+        struct adc_ring * ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+
+        if (!ring)
+                return NULL;
+        ring->map = vmalloc_user(ADC_RING_MAP_SIZE); /* zeroed */
+        if (!ring->map) {
+                kfree(ring);
+                return NULL;
+        }
+        atomic_set(&ring->refs, 1);
+        ring->hdr = ring->map;
+        ring->data = ring->map + PAGE_SIZE;
+        ring->size = ring->hdr->size = ADC_RING_SAMPLES;
+        ring->elem_size = ring->hdr->sample_size = ADC_SAMPLE_SIZE;
+        ring->hdr->data_offset = PAGE_SIZE;
+        return ring;
+}
+
+/* empty @ring and switch it to @size elements of @elem_size bytes;
+ * the producer must be off and the consumer locked out */
+static void adc_ring_format(struct adc_ring * ring, unsigned int size, size_t elem_size) {
+        ring->size = ring->hdr->size = size;
+        ring->elem_size = ring->hdr->sample_size = elem_size;
+        ring->hdr->head = ring->hdr->tail = 0;
+        ring->hdr->overruns = 0;
+        smp_wmb();
+}
+
+static void adc_ring_put(struct adc_ring * ring) {
+        if (atomic_dec_and_test(&ring->refs)) {
+                vfree(ring->map);
+                kfree(ring);
+        }
+}
+
+/* a reference to the ring of @dev, for adc_ring_put(); NULL once the
+ * teensy is gone */
+static struct adc_ring * adc_ring_get(struct adc_dev_t * dev) {
+        struct adc_ring * ring;
+
+        spin_lock(&adc_ring_lock);
+        ring = dev->ring;
+        if (ring)
+                atomic_inc(&ring->refs);
+        spin_unlock(&adc_ring_lock);
+        return ring;
+}
+
+/* the samples waiting in @ring, at most the whole ring even if a
+ * userland consumer scribbled on tail */
+static unsigned int adc_ring_count(struct adc_ring * ring) {
+        return min_t(unsigned int, ACCESS_ONCE(ring->hdr->head) - ACCESS_ONCE(ring->hdr->tail),
+                     ring->size);
+}
+
+/* put @elem, ring->elem_size bytes, on @ring, the producer side.
+ *
+ * @return: false if the ring is full and @elem was dropped
+ */
+static bool adc_ring_push(struct adc_ring * ring, const void * elem) {
+        unsigned int head = ring->hdr->head;
+
+        if (head - ACCESS_ONCE(ring->hdr->tail) >= ring->size) {
+                ring->hdr->overruns++;
+                return false;
+        }
+        smp_mb(); /* the consumer is done with the slot before we fill it */
+        memcpy(ring->data + (head & (ring->size - 1)) * ring->elem_size,
+               elem, ring->elem_size);
+        smp_wmb(); /* publish the element before head */
+        ring->hdr->head = head + 1;
+        return true;
+}
+
+/* tell the teensy to scan @mask every @ticks ADC_STREAM_TICK_US, with
+ * @flags (ADC_STREAM_*), or to stop if @mask is 0. Call with
+ * stream_mutex held.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_stream_ctl(uint16_t mask, uint16_t ticks, uint8_t flags) {
+        int ret;
+        struct teensy_request *req = teensy_alloc_request(GFP_KERNEL);
+
+        if (req == NULL)
+                return -ENOMEM;
+
+        req->buf[0] = 's';
+        if (mask) {
+                req->buf[1] = 'b';
+                req->buf[2] = mask & 0xff;
+                req->buf[3] = mask >> 8;
+                req->buf[4] = ticks & 0xff;
+                req->buf[5] = ticks >> 8;
+                req->buf[6] = flags;
+                req->size = 1+1+2+2+1;
+        } else {
+                req->buf[1] = 'e';
+                req->size = 1+1;
+        }
+
+        ret = teensy_send(req);
+        if (ret >= 0)
+                ret = (req->size >= 1 && req->buf[0] == 0) ? 0 : -EIO;
+
+        teensy_free_request(req);
+        return ret;
+}
+
+/* stop the stream, if any, and wake its readers so they can drain
+ * what's left. Call with stream_mutex held. */
+static void adc_stream_stop(void) {
+        int i;
+
+        if (!stream_mask)
+                return;
+        if (adc_stream_ctl(0, 0, 0) < 0)
+                pk("adc_stream_stop(): teensy didn't stop streaming\n");
+        stream_mask = 0;
+        stream_owner = NULL;
+        for (i = 0; i < ADC_NUM_DEVS; ++i) {
+                pk("adc_stream_stop(): adc%d lost %u samples to a full ring\n",
+                   i, adc_devs[i].ring->hdr->overruns);
+                wake_up_interruptible(&adc_devs[i].wait);
+        }
+        pk("adc_stream_stop(): %u stream frames lost\n", stream_lost);
+}
+
+/* note the sequence byte @seq of a stream frame, counting the frames
+ * lost since the last one */
+static void adc_stream_seq(uint8_t seq) {
+        if (stream_synced && seq != stream_seq)
+                stream_lost += (uint8_t)(seq - stream_seq);
+        stream_seq = seq + 1;
+        stream_synced = true;
+}
+
+/* the ring of @unit, if it's streaming in @elem_size elements */
+static struct adc_ring * adc_stream_ring(unsigned int unit, size_t elem_size) {
+        if (unit >= ADC_NUM_DEVS || !(ACCESS_ONCE(stream_mask) & (1 << unit)))
+                return NULL;
+        if (adc_devs[unit].ring->elem_size != elem_size)
+                return NULL;
+        return adc_devs[unit].ring;
+}
+
+/* wake the readers of the units in @woken */
+static void adc_stream_wake(unsigned int woken) {
+        unsigned int unit;
+
+        for (unit = 0; unit < ADC_NUM_DEVS; ++unit)
+                if (woken & (1 << unit))
+                        wake_up_interruptible(&adc_devs[unit].wait);
+}
+
+/*
+ * adc_stream_handler
+ *
+ * takes the stream frames the teensy sends for 'a': a sequence byte,
+ * then samples, each 2 bytes, high byte first, with the unit in the
+ * top 4 bits. Each sample goes on the ring of its unit.
+ *
+ * runs from the teensy driver's workqueue
+ */
+static void adc_stream_handler(const unsigned char *payload, size_t size,
+                               ktime_t received) {
+        struct adc_ring * ring;
+        unsigned char sample[ADC_SAMPLE_SIZE];
+        unsigned int unit, woken = 0;
+        size_t i;
+
+        if (size < 1)
+                return;
+        adc_stream_seq(payload[0]);
+
+        for (i = 1; i + ADC_SAMPLE_SIZE <= size; i += ADC_SAMPLE_SIZE) {
+                unit = payload[i] >> 4;
+                if (!(ring = adc_stream_ring(unit, ADC_SAMPLE_SIZE)))
+                        continue;
+                sample[0] = payload[i] & 0x0f;
+                sample[1] = payload[i + 1];
+                if (adc_ring_push(ring, sample))
+                        woken |= 1 << unit;
+        }
+
+        adc_stream_wake(woken);
+}
+
+/* the unit after @unit in @mask, which isn't 0, going round */
+static unsigned int adc_next_unit(uint16_t mask, unsigned int unit) {
+        do
+                unit = (unit + 1) % ADC_NUM_DEVS;
+        while (!(mask & (1 << unit)));
+        return unit;
+}
+
+/*
+ * adc_byte_handler
+ *
+ * takes the stream frames the teensy sends for 'b' when streaming
+ * with ADC_STREAM_8BIT: a sequence byte, the unit of the first
+ * sample, then samples of one byte each, going round the mask.
+ *
+ * runs from the teensy driver's workqueue
+ */
+static void adc_byte_handler(const unsigned char *payload, size_t size,
+                             ktime_t received) {
+        uint16_t mask = ACCESS_ONCE(stream_mask);
+        struct adc_ring * ring;
+        unsigned int unit, woken = 0;
+        size_t i;
+
+        if (size < 2)
+                return;
+        adc_stream_seq(payload[0]);
+
+        unit = payload[1];
+        if (unit >= ADC_NUM_DEVS || !(mask & (1 << unit)))
+                return;
+        for (i = 2; i < size; ++i, unit = adc_next_unit(mask, unit))
+                if ((ring = adc_stream_ring(unit, ADC_BYTE_SAMPLE_SIZE)) &&
+                    adc_ring_push(ring, payload + i))
+                        woken |= 1 << unit;
+
+        adc_stream_wake(woken);
+}
+
+/*
+ * adc_packed_handler
+ *
+ * takes the stream frames the teensy sends for 'p' when streaming
+ * with ADC_STREAM_PACKED: a sequence byte, the unit of the first
+ * sample, then groups of 4 samples going round the mask, each the top
+ * 8 bits of the 4 and a byte with their low 2 bits, first sample
+ * highest. The last group may be short: k samples in k+1 bytes.
+ *
+ * runs from the teensy driver's workqueue
+ */
+static void adc_packed_handler(const unsigned char *payload, size_t size,
+                               ktime_t received) {
+        uint16_t mask = ACCESS_ONCE(stream_mask);
+        struct adc_ring * ring;
+        unsigned char sample[ADC_SAMPLE_SIZE];
+        unsigned int unit, woken = 0, n, k;
+        uint16_t val;
+        uint8_t low;
+        size_t i;
+
+        if (size < 2)
+                return;
+        adc_stream_seq(payload[0]);
+
+        unit = payload[1];
+        if (unit >= ADC_NUM_DEVS || !(mask & (1 << unit)))
+                return;
+        for (i = 2; i + 1 < size; i += 5) {
+                n = min_t(size_t, size - i, 5) - 1;
+                low = payload[i + n];
+                for (k = 0; k < n; ++k, unit = adc_next_unit(mask, unit)) {
+                        val = (payload[i + k] << 2) | ((low >> (6 - 2*k)) & 3);
+                        if (!(ring = adc_stream_ring(unit, ADC_SAMPLE_SIZE)))
+                                continue;
+                        sample[0] = val >> 8;
+                        sample[1] = val & 0xff;
+                        if (adc_ring_push(ring, sample))
+                                woken |= 1 << unit;
+                }
+        }
+
+        adc_stream_wake(woken);
+}
+
+/*
+ * adc_record_handler
+ *
+ * takes the stream frames the teensy sends for 't' when streaming
+ * with ADC_STREAM_RECORDS: a sequence byte, then for each sample 2
+ * bytes of sample as for 'a', 2 bytes of scan number and 4 bytes of
+ * device time, all high byte first. Each becomes a struct adc_record
+ * on the ring of its unit, stamped with @received.
+ *
+ * runs from the teensy driver's workqueue
+ */
+#define ADC_WIRE_RECORD_SIZE (2+2+4)
+static void adc_record_handler(const unsigned char *payload, size_t size,
+                               ktime_t received) {
+        struct adc_ring * ring;
+        struct adc_record rec;
+        const unsigned char * p;
+        unsigned int unit, woken = 0;
+        uint16_t scan;
+        size_t i;
+
+        if (size < 1)
+                return;
+        adc_stream_seq(payload[0]);
+
+        memset(&rec, 0x00, sizeof(rec));
+        rec.host_ns = ktime_to_ns(received);
+
+        for (i = 1; i + ADC_WIRE_RECORD_SIZE <= size; i += ADC_WIRE_RECORD_SIZE) {
+                p = payload + i;
+
+                /* widen the scan number, which only ever moves on a
+                 * little between samples */
+                scan = (p[2] << 8) | p[3];
+                stream_scan += (int16_t)(scan - (uint16_t)stream_scan);
+
+                unit = p[0] >> 4;
+                if (!(ring = adc_stream_ring(unit, ADC_RECORD_SIZE)))
+                        continue;
+                rec.channel = unit;
+                rec.value = ((p[0] & 0x0f) << 8) | p[1];
+                rec.seq = stream_scan;
+                rec.device_time = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+                if (adc_ring_push(ring, &rec))
+                        woken |= 1 << unit;
+        }
+
+        adc_stream_wake(woken);
+}
+
+/*
+ * adc_capture_handler
+ *
+ * takes the frames a finished burst capture comes in for 'c': the
+ * capture id, the offset and total of the capture, low byte first,
+ * then samples of one byte each. A frame out of order means one got
+ * lost, and fails the capture.
+ *
+ * runs from the teensy driver's workqueue
+ */
+static void adc_capture_handler(const unsigned char *payload, size_t size,
+                                ktime_t received) {
+        unsigned int offset, total, n;
+
+        if (size < 1+2+2)
+                return;
+        offset = payload[1] | (payload[2] << 8);
+        total = payload[3] | (payload[4] << 8);
+        n = size - (1+2+2);
+
+        spin_lock(&capture_lock);
+        if (!capture_owner || capture_status || payload[0] != capture_id)
+                goto out;
+
+        if (offset != capture_len || total != ADC_CAPTURE_SAMPLES ||
+            offset + n > total) {
+                printk(KERN_ERR "adc: capture frame at %u of %u, expected %u\n",
+                       offset, total, capture_len);
+                capture_status = -EIO;
+        } else {
+                memcpy(capture_buf + offset, payload + 1+2+2, n);
+                capture_len += n;
+                if (capture_len == total)
+                        capture_status = 1;
+        }
+        if (capture_status)
+                wake_up_interruptible(&adc_devs[capture_unit].wait);
+out:
+        spin_unlock(&capture_lock);
+}
+
+/* arm (@cfg) or cancel (NULL) the burst capture on the teensy for
+ * @filp's @unit. Call with capture_mutex held.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_capture_ctl(struct file * filp, unsigned int unit,
+                           struct adc_capture * cfg) {
+        struct teensy_request *req;
+        int ret;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        /* from here on, frames of an earlier capture are ignored */
+        spin_lock(&capture_lock);
+        capture_owner = cfg ? filp : NULL;
+        capture_unit = unit;
+        capture_id++;
+        capture_len = 0;
+        capture_pos = 0;
+        capture_status = 0;
+        spin_unlock(&capture_lock);
+
+        req->buf[0] = 'a';
+        if (cfg) {
+                req->buf[1] = ADC_CAPTURE_UNIT;
+                req->buf[2] = capture_id;
+                req->buf[3] = unit;
+                req->buf[4] = cfg->trigger;
+                req->buf[5] = cfg->level;
+                req->buf[6] = cfg->pre & 0xff;
+                req->buf[7] = cfg->pre >> 8;
+                req->size = 1+1+1+1+1+1+2;
+        } else {
+                req->buf[1] = ADC_CANCEL_UNIT;
+                req->size = 1+1;
+        }
+
+        ret = teensy_send(req);
+        if (ret >= 0)
+                ret = (req->size >= 1 && req->buf[0] == 0) ? 0 : -EIO;
+        if (ret < 0 && cfg) {
+                spin_lock(&capture_lock);
+                capture_owner = NULL;
+                spin_unlock(&capture_lock);
+                wake_up_interruptible(&adc_devs[unit].wait);
+        }
+
+        teensy_free_request(req);
+        return ret;
+}
+
+/* read() on the file that armed a capture: wait for it to come in,
+ * then hand it over
+ *
+ * @return: bytes read, or < 0 on failure
+ */
+static ssize_t adc_read_capture(struct file * filp, struct adc_dev_t * dev,
+                                char __user *buf, size_t count) {
+        unsigned int n;
+        ssize_t ret;
+
+        /* wait without capture_mutex, which arming and closing take */
+        for (;;) {
+                if (!(filp->f_flags & O_NONBLOCK) &&
+                    wait_event_interruptible(dev->wait, ACCESS_ONCE(capture_status) ||
+                                             ACCESS_ONCE(capture_owner) != filp))
+                        return -ERESTARTSYS;
+                if (mutex_lock_interruptible(&capture_mutex))
+                        return -ERESTARTSYS;
+                if (capture_owner != filp || capture_status)
+                        break;
+                mutex_unlock(&capture_mutex); /* re-armed meanwhile */
+                if (filp->f_flags & O_NONBLOCK)
+                        return -EAGAIN;
+        }
+        if (capture_owner != filp) {
+                ret = -EIO; /* arming it again failed */
+                goto out;
+        }
+        smp_rmb(); /* the samples are in before the status says so */
+
+        if ((ret = capture_status) < 0) {
+                capture_owner = NULL;
+                goto out;
+        }
+
+        /* no more frames once it's all in, so the buffer holds still */
+        n = min_t(size_t, count, ADC_CAPTURE_SAMPLES - capture_pos);
+        if (copy_to_user(buf, capture_buf + capture_pos, n)) {
+                ret = -EFAULT;
+                goto out;
+        }
+        capture_pos += n;
+        if (capture_pos == ADC_CAPTURE_SAMPLES)
+                capture_owner = NULL;
+        ret = n;
+out:
+        mutex_unlock(&capture_mutex);
+        return ret;
+}
+
+/*
+ * adc_block_handler
+ *
+ * takes the frames a block read comes in for 'n': the block id, the
+ * offset, low byte first, then samples of 2 bytes each, high byte
+ * first. A frame out of order means one got lost, and fails the
+ * block.
+ *
+ * runs from the teensy driver's workqueue
+ */
+static void adc_block_handler(const unsigned char *payload, size_t size,
+                              ktime_t received) {
+        unsigned int offset, n;
+
+        if (size < 1+2)
+                return;
+        offset = payload[1] | (payload[2] << 8);
+        n = (size - (1+2)) / ADC_SAMPLE_SIZE;
+
+        spin_lock(&block_lock);
+        if (!block_buf || block_status || payload[0] != block_id)
+                goto out;
+
+        if (offset != block_len || offset + n > block_count) {
+                printk(KERN_ERR "adc: block frame at %u of %u, expected %u\n",
+                       offset, block_count, block_len);
+                block_status = -EIO;
+        } else {
+                memcpy(block_buf + offset * ADC_SAMPLE_SIZE, payload + 1+2,
+                       n * ADC_SAMPLE_SIZE);
+                block_len += n;
+                if (block_len == block_count)
+                        block_status = 1;
+        }
+        if (block_status)
+                wake_up_interruptible(&block_wait);
+out:
+        spin_unlock(&block_lock);
+}
+
+/* start a block read of @count samples of @unit, @ticks apart, or
+ * stop it if @count is 0. Call with block_mutex held.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_block_ctl(unsigned int unit, unsigned int count, unsigned int ticks) {
+        struct teensy_request *req;
+        int ret;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        req->buf[0] = 'a';
+        if (count) {
+                req->buf[1] = ADC_BLOCK_UNIT;
+                req->buf[2] = block_id;
+                req->buf[3] = unit;
+                req->buf[4] = count & 0xff;
+                req->buf[5] = count >> 8;
+                req->buf[6] = ticks & 0xff;
+                req->buf[7] = ticks >> 8;
+                req->size = 1+1+1+1+2+2;
+        } else {
+                req->buf[1] = ADC_UNBLOCK_UNIT;
+                req->size = 1+1;
+        }
+
+        ret = teensy_send(req);
+        if (ret >= 0)
+                ret = (req->size >= 1 && req->buf[0] == 0) ? 0 : -EIO;
+
+        teensy_free_request(req);
+        return ret;
+}
+
+/* ADC_IOC_READ_N: have the teensy take @rn->count samples of @unit
+ * and copy them out to @rn->buf
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_read_n(unsigned int unit, struct adc_read_n * rn) {
+        unsigned char * buf;
+        unsigned int ticks;
+        long left;
+        int ret;
+
+        if (rn->count == 0 || rn->count > ADC_READ_N_MAX)
+                return -EINVAL;
+        ticks = DIV_ROUND_UP(rn->period_us, ADC_STREAM_TICK_US);
+        ticks = clamp_t(unsigned int, ticks, 1, 0xffff);
+
+        buf = kmalloc(rn->count * ADC_SAMPLE_SIZE, GFP_KERNEL);
+        if (!buf)
+                return -ENOMEM;
+
+        if (mutex_lock_interruptible(&block_mutex)) {
+                kfree(buf);
+                return -ERESTARTSYS;
+        }
+
+        /* from here on, frames of an earlier block are ignored */
+        spin_lock(&block_lock);
+        block_buf = buf;
+        block_id++;
+        block_len = 0;
+        block_count = rn->count;
+        block_status = 0;
+        spin_unlock(&block_lock);
+
+        if ((ret = adc_block_ctl(unit, rn->count, ticks)) < 0)
+                goto out;
+
+        /* ticks are a tenth of a ms; give USB a second on top */
+        left = wait_event_interruptible_timeout(block_wait, ACCESS_ONCE(block_status),
+                        msecs_to_jiffies(rn->count * ticks / 10) + HZ);
+        if (left <= 0) {
+                ret = left < 0 ? -ERESTARTSYS : -ETIMEDOUT;
+                if (adc_block_ctl(unit, 0, 0) < 0)
+                        pk("adc_read_n(): teensy didn't stop the block\n");
+                goto out;
+        }
+        smp_rmb(); /* the samples are in before the status says so */
+
+        if ((ret = block_status) < 0)
+                goto out;
+        ret = 0;
+        if (copy_to_user((void __user *)(unsigned long)rn->buf, buf,
+                         rn->count * ADC_SAMPLE_SIZE))
+                ret = -EFAULT;
+out:
+        spin_lock(&block_lock);
+        block_buf = NULL;
+        spin_unlock(&block_lock);
+        mutex_unlock(&block_mutex);
+        kfree(buf);
+        return ret;
+}
+
+/* read() on a streaming unit: wait for samples, then hand over as
+ * many as fit in @count, straight from the ring
+ *
+ * @return: bytes read, 0 once the stream has stopped and the ring is
+ * empty, or < 0 on failure
+ */
+static ssize_t adc_read_stream(struct file * filp, struct adc_dev_t * dev, uint16_t bit,
+                               char __user *buf, size_t count) {
+        struct adc_ring * ring;
+        unsigned int tail, n, off, first;
+        size_t elem_size;
+        ssize_t ret;
+
+        if (!(ring = adc_ring_get(dev)))
+                return -ENODEV;
+
+        if (filp->f_flags & O_NONBLOCK) {
+                if (!mutex_trylock(&dev->read_mutex)) {
+                        adc_ring_put(ring);
+                        return -EAGAIN;
+                }
+                if (!adc_ring_count(ring) && (ACCESS_ONCE(stream_mask) & bit)) {
+                        ret = -EAGAIN;
+                        goto out;
+                }
+        } else if (mutex_lock_interruptible(&dev->read_mutex)) {
+                adc_ring_put(ring);
+                return -ERESTARTSYS;
+        }
+
+        /* the format only changes under read_mutex */
+        elem_size = ring->elem_size;
+        n = count / elem_size;
+        if (n == 0) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        ret = wait_event_interruptible(dev->wait, adc_ring_count(ring) ||
+                                       !(ACCESS_ONCE(stream_mask) & bit) ||
+                                       ACCESS_ONCE(dev->gone));
+        if (ret)
+                goto out;
+        if (ACCESS_ONCE(dev->gone)) {
+                ret = -ENODEV;
+                goto out;
+        }
+
+        tail = ACCESS_ONCE(ring->hdr->tail);
+        n = min(n, adc_ring_count(ring));
+        smp_rmb(); /* read the samples only after seeing head */
+
+        /* at most two pieces, either side of the end of the ring */
+        off = tail & (ring->size - 1);
+        first = min(n, ring->size - off);
+        if (copy_to_user(buf, ring->data + off * elem_size, first * elem_size) ||
+            copy_to_user(buf + first * elem_size, ring->data, (n - first) * elem_size)) {
+                ret = -EFAULT;
+                goto out;
+        }
+
+        smp_mb(); /* done with the slots before giving them back */
+        ring->hdr->tail = tail + n;
+        ret = n * elem_size;
+out:
+        mutex_unlock(&dev->read_mutex);
+        adc_ring_put(ring);
+        return ret;
+}
+
+/* the samples waiting on the ring of @dev, 0 if it's gone */
+static unsigned int adc_ring_queued(struct adc_dev_t * dev) {
+        struct adc_ring * ring = adc_ring_get(dev);
+        unsigned int n;
+
+        if (!ring)
+                return 0;
+        n = adc_ring_count(ring);
+        adc_ring_put(ring);
+        return n;
+}
+
+/* callback for a single read in flight: flag it and wake the reader,
+ * or clean up after a reader that has closed the file */
+static void adc_read_complete(struct teensy_request * req) {
+        struct adc_filp_data * data;
+        unsigned long flags;
+
+        spin_lock_irqsave(&adc_async_lock, flags);
+        data = req->context;
+        if (data) {
+                data->ready = true;
+                wake_up_interruptible(&data->wait);
+        }
+        spin_unlock_irqrestore(&adc_async_lock, flags);
+
+        if (!data)
+                teensy_free_request(req);
+}
+
+/* send a single read for @data's unit, unless one is in flight
+ * already. Call with data->lock held.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_read_start(struct adc_filp_data * data) {
+        struct teensy_request *req;
+        int ret;
+
+        if (data->pending)
+                return 0;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL) {
+                pk("adc_read_start(): no request available\n");
+                return -ENOMEM;
+        }
+
+        req->buf[0] = 'a';
+	req->buf[1] = (uint8_t)data->unit;          // stow the unit number for adc access
+        req->size = 2;
+
+        data->ready = false;
+        data->pending = req;
+        if ((ret = teensy_send_async(req, adc_read_complete, data)) < 0) {
+                pk("adc_read_start(): error calling teensy_send_async()\n");
+                data->pending = NULL;
+                teensy_free_request(req);
+        }
+        return ret;
+}
+
+/* scan the channels in @scan->mask on the teensy in one request and
+ * fill in @scan->values
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_scan(struct adc_scan * scan) {
+        /* request: ['a'][ADC_SCAN_UNIT][mask lo][mask hi]
+         * reply:   [mask lo][mask hi] then [value hi][value lo] for each
+         *          channel in mask, lowest first; mask 0 and no values
+         *          while a burst capture has the adc */
+        struct teensy_request *req;
+        unsigned int ch, off = 2;
+        uint16_t reply_mask;
+        int ret;
+
+        if (scan->mask == 0 || scan->mask >> ADC_NUM_CHANNELS)
+                return -EINVAL;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        req->buf[0] = 'a';
+        req->buf[1] = ADC_SCAN_UNIT;
+        req->buf[2] = scan->mask & 0xff;
+        req->buf[3] = scan->mask >> 8;
+        req->size = 1+1+2;
+
+        if ((ret = teensy_send(req)) < 0)
+                goto out;
+
+        ret = -EIO;
+        if (req->size < 2)
+                goto out;
+        reply_mask = (uint8_t)req->buf[0] | ((uint8_t)req->buf[1] << 8);
+        if (reply_mask == 0)
+                ret = -EBUSY;
+        if (reply_mask != scan->mask)
+                goto out;
+        for (ch = 0; ch < ADC_NUM_CHANNELS; ++ch) {
+                scan->values[ch] = 0;
+                if (!(scan->mask & (1 << ch)))
+                        continue;
+                if (off + 2 > req->size)
+                        goto out;
+                scan->values[ch] = ((uint8_t)req->buf[off] << 8) | (uint8_t)req->buf[off + 1];
+                off += 2;
+        }
+        ret = 0;
+out:
+        teensy_free_request(req);
+        return ret;
+}
+
 /*** API ***/
 
 int adc_open (struct inode *inode, struct file *filp) {
@@ -93,16 +979,46 @@ int adc_open (struct inode *inode, struct file *filp) {
                 return -ENOMEM;
         data->adc = dev;
 	data->unit = iminor(inode);
+        mutex_init(&data->lock);
+        data->pending = NULL;
+        data->ready = false;
+        init_waitqueue_head(&data->wait);
         filp->private_data = data;
 
         return 0;
 }
 
 int adc_release (struct inode * inode, struct file * filp) {
-        //struct adc_dev_t * dev = _get_private_data(filp)->adc;
+        struct adc_filp_data * data = _get_private_data(filp);
+        struct teensy_request * req;
+        unsigned long flags;
 
         pk("release(): iminor=%d, filp=%p\n", iminor(inode), filp);
 
+        /* a single read still in flight is left for its callback to
+         * free */
+        spin_lock_irqsave(&adc_async_lock, flags);
+        req = data->pending;
+        if (req && !data->ready) {
+                req->context = NULL;
+                req = NULL;
+        }
+        spin_unlock_irqrestore(&adc_async_lock, flags);
+        if (req)
+                teensy_free_request(req);
+
+        mutex_lock(&stream_mutex);
+        if (stream_owner == filp)
+                adc_stream_stop();
+        mutex_unlock(&stream_mutex);
+
+        if (ACCESS_ONCE(capture_owner) == filp) {
+                mutex_lock(&capture_mutex);
+                if (capture_owner == filp && adc_capture_ctl(filp, data->unit, NULL) < 0)
+                        pk("release(): teensy didn't cancel the capture\n");
+                mutex_unlock(&capture_mutex);
+        }
+
         kfree(filp->private_data);
         return 0;
 }
@@ -111,63 +1027,335 @@ int adc_release (struct inode * inode, struct file * filp) {
 /* @buf:
  * @count:
  * @return:
+ *
+ * a file that armed a capture reads the capture; a unit that is
+ * streaming, or still has streamed samples left, is read from its
+ * ring; any other takes one sample from the teensy.
+ * With O_NONBLOCK, a read that would have to wait returns -EAGAIN; a
+ * single read is sent anyway, and a later read() picks up its reply.
  */
 ssize_t adc_read (struct file *filp, char __user *buf, size_t count, loff_t *pos)
 {
-        //struct adc_dev_t * dev = _get_private_data(filp)->adc;
+        struct adc_dev_t * dev = _get_private_data(filp)->adc;
         int ret = 0;
 	struct adc_filp_data *adc_devp = filp->private_data;	// pointer to the key structure
-        char * mybuf = kmalloc(2, GFP_KERNEL);
-        struct teensy_request req = {
-                .buf   = mybuf,
-                .size  = 2,
-        };
+        uint16_t bit = 1 << adc_devp->unit;
+        struct teensy_request *req;
 
         pk("read(): buf=%p, count=%zu, *pos=0x%X\n",  buf, count, ui *pos);
 
-        if (mybuf == NULL) {
-                pk("adc_read(): no mem when allocing zero bytes\n");
-                return -ENOMEM;
+        if (ACCESS_ONCE(dev->gone))
+                return -ENODEV;
+        if (ACCESS_ONCE(capture_owner) == filp)
+                return adc_read_capture(filp, dev, buf, count);
+        if ((ACCESS_ONCE(stream_mask) & bit) || adc_ring_queued(dev))
+                return adc_read_stream(filp, dev, bit, buf, count);
+
+        if (mutex_lock_interruptible(&adc_devp->lock))
+                return -ERESTARTSYS;
+
+        /* send a request, unless an earlier read already did; the
+         * reply comes back in req->buf */
+        if ((ret = adc_read_start(adc_devp)) < 0)
+                goto unlock;
+
+        if (!adc_devp->ready) {
+                if (filp->f_flags & O_NONBLOCK) {
+                        ret = -EAGAIN;
+                        goto unlock;
+                }
+                /* if we're interrupted the request stays pending for
+                 * the next read */
+                if (wait_event_interruptible(adc_devp->wait, adc_devp->ready)) {
+                        ret = -ERESTARTSYS;
+                        goto unlock;
+                }
         }
+        req = adc_devp->pending;
+        adc_devp->pending = NULL;
 
-        req.buf[0] = 'a';
-	req.buf[1] = (uint8_t)adc_devp->unit;          // stow the unit number for adc access
-        
-        /* pass request to teensy_send() */
-        /* teensy_send() returns a DIFFERENT buf in req->buf, so we must
-           free that; our mybuf was already free'd in teensy_send().
-        */
-        ret = teensy_send(&req);
-        if (ret < 0) {
-                pk("adc_read(): error calling teensy_send()\n");
-                return ret;
+        if ((ret = req->status) < 0) {
+                pk("adc_read(): request failed: %d\n", ret);
+                goto out;
         }
-        printk(KERN_DEBUG "adc_read(): read %zu bytes from teensy\n", req.size);
+        printk(KERN_DEBUG "adc_read(): read %zu bytes from teensy\n", req->size);
 
 
         /* copy data to user buf */
-        ret = req.size < count ? req.size : count; /* min */
-        if (copy_to_user(buf, req.buf, ret)) {
+        ret = req->size < count ? req->size : count; /* min */
+        if (copy_to_user(buf, req->buf, ret)) {
                 ret = -EFAULT;
                 pk("adc_read(): copy_to_user() failed\n");
-                return ret;
+                goto out;
         }
         printk(KERN_DEBUG "adc_read(): copied %i bytes to userbuf\n", ret);
 
-        kfree(req.buf); /* free the NEW buf */
+out:
+        teensy_free_request(req);
+unlock:
+        mutex_unlock(&adc_devp->lock);
 
         return ret;
 }
 
+/* readable when read() won't block: a capture is in, a streaming unit
+ * has samples, or the reply to a single read is in. Polling a unit that isn't
+ * streaming sends a single read if none is in flight, so the reply
+ * has something to arrive for. */
+unsigned int adc_poll (struct file * filp, poll_table * wait) {
+        struct adc_filp_data * data = _get_private_data(filp);
+        struct adc_dev_t * dev = data->adc;
+        uint16_t bit = 1 << data->unit;
+        unsigned int mask = 0;
+
+        if (ACCESS_ONCE(dev->gone))
+                return POLLERR;
+
+        poll_wait(filp, &dev->wait, wait);
+        poll_wait(filp, &data->wait, wait);
+
+        if (ACCESS_ONCE(capture_owner) == filp)
+                return ACCESS_ONCE(capture_status) ? POLLIN | POLLRDNORM : 0;
+        if ((ACCESS_ONCE(stream_mask) & bit) || adc_ring_queued(dev))
+                return adc_ring_queued(dev) ? POLLIN | POLLRDNORM : 0;
+
+        mutex_lock(&data->lock);
+        if (adc_read_start(data) < 0)
+                mask |= POLLERR;
+        else if (data->ready)
+                mask |= POLLIN | POLLRDNORM;
+        mutex_unlock(&data->lock);
+
+        return mask;
+}
+
+/* the mapping of a ring holds a reference to it */
+static void adc_vma_open(struct vm_area_struct * vma) {
+        struct adc_ring * ring = vma->vm_private_data;
+        atomic_inc(&ring->refs);
+}
+
+static void adc_vma_close(struct vm_area_struct * vma) {
+        adc_ring_put(vma->vm_private_data);
+}
+
+static struct vm_operations_struct adc_vm_ops = {
+        .open  = adc_vma_open,
+        .close = adc_vma_close,
+};
+
+/* map the unit's sample ring, header page first; see struct
+ * adc_ring_header for how to consume it */
+int adc_mmap (struct file * filp, struct vm_area_struct * vma) {
+        struct adc_dev_t * dev = _get_private_data(filp)->adc;
+        struct adc_ring * ring;
+        int ret;
+
+        pk("mmap(): filp=%p, size=%lu\n", filp, vma->vm_end - vma->vm_start);
+
+        if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ADC_RING_MAP_SIZE)
+                return -EINVAL;
+        if (!(ring = adc_ring_get(dev)))
+                return -ENODEV;
+
+        if ((ret = remap_vmalloc_range(vma, ring->map, 0)) < 0) {
+                adc_ring_put(ring);
+                return ret;
+        }
+
+        /* the mapping takes over our reference */
+        vma->vm_ops = &adc_vm_ops;
+        vma->vm_private_data = ring;
+        return 0;
+}
+
+int adc_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsigned long arg) {
+        struct adc_dev_t * dev = _get_private_data(filp)->adc;
+        uint16_t bit = 1 << _get_private_data(filp)->unit;
+        struct adc_stream cfg;
+        struct adc_scan scan;
+        struct adc_capture capture;
+        struct adc_read_n rn;
+        struct adc_ring * ring;
+        unsigned int ticks;
+        int ret = 0, i;
+
+        pk("adc_ioctl(): iminor=%d, filp=%p, cmd=0x%X, arg=0x%X\n",
+           iminor(inode), filp, ui cmd, ui arg);
+
+        switch (cmd) {
+
+        case ADC_IOC_STREAM_START:
+                if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+                        return -EFAULT;
+                if (cfg.mask == 0 || cfg.mask >> ADC_NUM_DEVS)
+                        return -EINVAL;
+                if ((cfg.flags & ~ADC_STREAM_FLAGS) || hweight32(cfg.flags) > 1)
+                        return -EINVAL;
+                ticks = DIV_ROUND_UP(cfg.period_us, ADC_STREAM_TICK_US);
+                ticks = clamp_t(unsigned int, ticks, 1, 0xffff);
+
+                mutex_lock(&stream_mutex);
+                adc_stream_stop();
+                stream_synced = false;
+                stream_lost = 0;
+                stream_scan = 0;
+
+                /* start the rings over in the new format */
+                for (i = 0; i < ADC_NUM_DEVS; ++i) {
+                        /* gone: adc_stream_ctl() fails anyway */
+                        if (!(cfg.mask & (1 << i)) || !adc_devs[i].ring)
+                                continue;
+                        mutex_lock(&adc_devs[i].read_mutex);
+                        if (cfg.flags & ADC_STREAM_RECORDS)
+                                adc_ring_format(adc_devs[i].ring, ADC_RING_RECORDS,
+                                                ADC_RECORD_SIZE);
+                        else if (cfg.flags & ADC_STREAM_8BIT)
+                                adc_ring_format(adc_devs[i].ring, ADC_RING_SAMPLES,
+                                                ADC_BYTE_SAMPLE_SIZE);
+                        else
+                                adc_ring_format(adc_devs[i].ring, ADC_RING_SAMPLES,
+                                                ADC_SAMPLE_SIZE);
+                        mutex_unlock(&adc_devs[i].read_mutex);
+                }
+
+                if ((ret = adc_stream_ctl(cfg.mask, ticks, cfg.flags)) == 0) {
+                        stream_mask = cfg.mask;
+                        stream_owner = filp;
+                }
+                mutex_unlock(&stream_mutex);
+                return ret;
+
+        case ADC_IOC_STREAM_STOP:
+                mutex_lock(&stream_mutex);
+                adc_stream_stop();
+                mutex_unlock(&stream_mutex);
+                return 0;
+
+        case ADC_IOC_SCAN:
+                if (copy_from_user(&scan, (void __user *)arg, sizeof(scan)))
+                        return -EFAULT;
+                if ((ret = adc_scan(&scan)) < 0)
+                        return ret;
+                if (copy_to_user((void __user *)arg, &scan, sizeof(scan)))
+                        return -EFAULT;
+                return 0;
+
+        case ADC_IOC_CAPTURE:
+                if (copy_from_user(&capture, (void __user *)arg, sizeof(capture)))
+                        return -EFAULT;
+                if (capture.trigger > ADC_TRIGGER_BELOW ||
+                    capture.pre >= ADC_CAPTURE_SAMPLES)
+                        return -EINVAL;
+
+                mutex_lock(&capture_mutex);
+                if (capture_owner && capture_owner != filp)
+                        ret = -EBUSY;
+                else
+                        ret = adc_capture_ctl(filp, iminor(inode), &capture);
+                mutex_unlock(&capture_mutex);
+                return ret;
+
+        case ADC_IOC_READ_N:
+                if (copy_from_user(&rn, (void __user *)arg, sizeof(rn)))
+                        return -EFAULT;
+                return adc_read_n(iminor(inode), &rn);
+
+        case ADC_IOC_WAIT:
+                if (!(ring = adc_ring_get(dev)))
+                        return -ENODEV;
+                ret = wait_event_interruptible(dev->wait, adc_ring_count(ring) ||
+                                               !(ACCESS_ONCE(stream_mask) & bit) ||
+                                               ACCESS_ONCE(dev->gone));
+                if (ret == 0 && ACCESS_ONCE(dev->gone))
+                        ret = -ENODEV;
+                adc_ring_put(ring);
+                return ret;
+
+        default:
+                return -ENOTTY;
+        }
+}
+
 struct file_operations adc_fops = {
         .owner   = THIS_MODULE,
         .read    = adc_read,
         .open    = adc_open,
         .release = adc_release,
+        .ioctl   = adc_ioctl,
+        .mmap    = adc_mmap,
+        .poll    = adc_poll,
 };
 
 /*** setup/teardown ***/
 
+/* the frames the teensy sends on its own, by destination byte */
+static const struct {
+        unsigned char destination;
+        teensy_stream_t handler;
+} adc_streams[] = {
+        { 'a', adc_stream_handler },
+        { 't', adc_record_handler },
+        { 'b', adc_byte_handler },
+        { 'p', adc_packed_handler },
+        { 'c', adc_capture_handler },
+        { 'n', adc_block_handler },
+};
+#define ADC_NUM_STREAMS ((int)(sizeof(adc_streams)/sizeof(adc_streams[0])))
+
+/* unregister the first @n of adc_streams, last first */
+static void adc_unregister_streams(int n)
+{
+        while (n-- > 0)
+                teensy_unregister_stream(adc_streams[n].destination);
+}
+
+/* register all of adc_streams, or none of them
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int adc_register_streams(void)
+{
+        int i, result;
+
+        for (i = 0; i < ADC_NUM_STREAMS; ++i) {
+                result = teensy_register_stream(adc_streams[i].destination,
+                                                adc_streams[i].handler);
+                if (result < 0) {
+                        adc_unregister_streams(i);
+                        return result;
+                }
+        }
+        return 0;
+}
+
+/* tear down the first @n adc devices, last first */
+static void adc_destroy_devs(int n)
+{
+        struct adc_dev_t * dev;
+        struct adc_ring * ring;
+
+        while (n-- > 0) {
+                dev = &adc_devs[n];
+
+                /* no new references; readers and waiters see gone */
+                spin_lock(&adc_ring_lock);
+                ring = dev->ring;
+                dev->ring = NULL;
+                dev->gone = true;
+                spin_unlock(&adc_ring_lock);
+                wake_up_interruptible(&dev->wait);
+
+                /* sysfs and udev */
+                device_destroy(adc_class, MKDEV(MAJOR(adc_dev_number), n));
+                /* cdev */
+                cdev_del(&dev->cdev);
+
+                /* readers, waiters and mappings keep their own */
+                adc_ring_put(ring);
+        }
+}
+
 int adc_init(void)
 {
         struct adc_dev_t * dev;
@@ -185,37 +1373,58 @@ int adc_init(void)
         /* sysfs */
         adc_class = class_create(THIS_MODULE, DEVICE_NAME);
 
-        /* MAYBE FIXME: memory leak on failure? (if module load is unlike userland, where memory is freed on exit ...) */
         for (i = 0; i < ADC_NUM_DEVS; ++i) {
                 dev = &adc_devs[i];
 
+                /* stream ring */
+                dev->ring = adc_ring_alloc();
+                if (!dev->ring) {
+                        result = -ENOMEM;
+                        goto fail;
+                }
+                dev->gone = false;
+                mutex_init(&dev->read_mutex);
+                init_waitqueue_head(&dev->wait);
+
                 /* cdev */ /* mostly copying ELDD cmos from here on ... */
                 cdev_init(&dev->cdev, &adc_fops);
                 dev->cdev.owner = THIS_MODULE;
                 result = cdev_add(&dev->cdev, MKDEV(MAJOR(adc_dev_number), i), 1);
-                if (result < 0)
-                        return result;
+                if (result < 0) {
+                        adc_ring_put(dev->ring);
+                        dev->ring = NULL;
+                        goto fail;
+                }
 
                 /* udev /dev node creation */ /* returns pointer to /sys entry as well */
                 /* http://www.gnugeneration.com/books/linux/2.6.20/kernel-api/re694.html */
                 device_create(adc_class, NULL, MKDEV(MAJOR(adc_dev_number), i), DEVICE_NAME "%d", i);
         }
+
+        /* samples the teensy streams on its own */
+        stream_mask = 0;
+        stream_owner = NULL;
+        if ((result = adc_register_streams()) < 0)
+                goto fail;
         return 0;
+
+fail:
+        adc_destroy_devs(i);
+        unregister_chrdev_region(adc_dev_number, ADC_NUM_DEVS);
+        class_destroy(adc_class);
+        return result;
 }
 
 void adc_exit(void)
 {
-        int i;
-        struct adc_dev_t * dev;
-
-        for (i = 0; i < ADC_NUM_DEVS; ++i) {
-                dev = &adc_devs[i];
-
-                /* sysfs and udev */
-                device_destroy(adc_class, MKDEV(MAJOR(adc_dev_number), i));
-                /* cdev */
-                cdev_del(&dev->cdev);
-        }
+        /* the teensy is gone, so there's nobody to tell to stop;
+         * stream_mutex keeps STREAM_START off the rings meanwhile */
+        adc_unregister_streams(ADC_NUM_STREAMS);
+        mutex_lock(&stream_mutex);
+        stream_mask = 0;
+        stream_owner = NULL;
+        adc_destroy_devs(ADC_NUM_DEVS);
+        mutex_unlock(&stream_mutex);
 
         unregister_chrdev_region(adc_dev_number, ADC_NUM_DEVS);
         class_destroy(adc_class);
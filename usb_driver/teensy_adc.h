@@ -23,10 +23,138 @@
  * based on sstore.c
  */
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #ifndef __ADC_H__
 #define __ADC_H__
 
+/* ioctls; see teensy_mc.h for how the numbers were picked */
+/* streaming: the teensy scans the units in .mask every .period_us,
+ * rounded up to a multiple of ADC_STREAM_TICK_US, and sends the
+ * samples on its own. While a unit is streaming, read() on it blocks
+ * until samples are in and then returns as many as fit, 2 bytes each,
+ * high byte first, like a single read; or, with ADC_STREAM_RECORDS in
+ * .flags, a struct adc_record each. The stream stops on
+ * ADC_IOC_STREAM_STOP or when the file that started it is closed.
+ *
+ * To stream more samples a second, ADC_STREAM_8BIT converts faster
+ * and keeps just the top 8 bits, which go over the wire and come out
+ * of read() one byte each. ADC_STREAM_PACKED keeps all 10 bits but
+ * sends them 4 in 5 bytes; read() still gives 2 bytes a sample. At
+ * most one ADC_STREAM_* flag may be set. */
+#define ADC_STREAM_TICK_US 100
+
+struct adc_stream {
+        __u16 mask;         /* units to sample, bit n for /dev/adcn */
+        __u32 period_us;    /* time between scans of the whole mask */
+        __u32 flags;        /* ADC_STREAM_* */
+};
+
+#define ADC_STREAM_RECORDS 0x01
+#define ADC_STREAM_8BIT    0x02
+#define ADC_STREAM_PACKED  0x04
+
+/* the teensy's clock ticks every ADC_DEVICE_TICK_NS, and wraps at 32
+ * bits */
+#define ADC_DEVICE_TICK_NS 500
+
+/* a sample with the timing needed to tell sampling jitter from USB
+ * jitter: device_time is when the teensy sampled the pin, host_ns when
+ * the report carrying it came in, and seq counts scans, so a gap
+ * means lost samples */
+struct adc_record {
+        __u64 host_ns;      /* ktime at in urb completion, in ns */
+        __u32 device_time;  /* teensy clock at sampling */
+        __u32 seq;          /* scan number */
+        __u16 value;        /* the sample */
+        __u8  channel;      /* the unit */
+        __u8  reserved[5];
+};
+
+#define ADC_IOC_MAGIC 'A'
+#define ADC_IOC_STREAM_START _IOW(ADC_IOC_MAGIC, 42, struct adc_stream)
+#define ADC_IOC_STREAM_STOP  _IO(ADC_IOC_MAGIC, 43)
+
+/* mmap() of /dev/adcN, from offset 0, maps its sample ring: this
+ * header, then at .data_offset .size samples of .sample_size bytes
+ * each: 2 bytes, high byte first, or a struct adc_record, depending
+ * on how the stream was started. The header changes when a stream
+ * starts, so read it again then. The driver advances .head as samples come
+ * in. The consumer reads .head, issues a read barrier, takes the
+ * samples in [.tail, .head) (indices mod .size), issues a full
+ * barrier, and advances .tail. read() consumes from the same ring, so
+ * use one or the other. ADC_IOC_WAIT sleeps until the ring isn't
+ * empty, or the stream has stopped. */
+struct adc_ring_header {
+        __u32 head;          /* next sample the driver fills; driver writes */
+        __u32 tail;          /* next sample to consume; consumer writes */
+        __u32 size;          /* samples in the ring, a power of two */
+        __u32 sample_size;   /* bytes per sample */
+        __u32 data_offset;   /* where the samples start in the mapping */
+        __u32 overruns;      /* samples dropped on a full ring; driver writes */
+};
+
+#define ADC_IOC_WAIT _IO(ADC_IOC_MAGIC, 44)
+
+/* a scan converts every channel in .mask back to back on the teensy,
+ * in one request, and returns them in .values; works on any
+ * /dev/adcN. Channels are analogRead() pins, which go beyond the
+ * /dev/adcN units. A stream skips the scans that come due meanwhile;
+ * while a burst capture has the adc, it's -EBUSY. */
+#define ADC_NUM_CHANNELS 12
+
+struct adc_scan {
+        __u16 mask;                       /* channels to convert, bit n for channel n */
+        __u16 values[ADC_NUM_CHANNELS];   /* out: by channel; 0 if not in mask */
+};
+
+#define ADC_IOC_SCAN _IOWR(ADC_IOC_MAGIC, 45, struct adc_scan)
+
+/* burst capture: the teensy samples the unit back to back, the top 8
+ * bits every ADC_CAPTURE_PERIOD_NS, into a buffer of its own, far
+ * faster than a stream gets over USB. ADC_IOC_CAPTURE arms it; it
+ * starts on .trigger, at once or when the signal crosses .level
+ * rising or falling, or is above or below it, and keeps the .pre
+ * samples from before the trigger, fewer than ADC_CAPTURE_SAMPLES.
+ * Once the buffer is full the teensy sends it, and read() on the file
+ * that armed it returns the ADC_CAPTURE_SAMPLES samples, oldest
+ * first, one byte each, and -EIO if some got lost on the way. After
+ * the last one the file reads as before. There is one capture at a
+ * time: arming another file's unit fails with -EBUSY. Streams skip
+ * their scans while the teensy captures. */
+#define ADC_CAPTURE_SAMPLES 1024
+#define ADC_CAPTURE_PERIOD_NS 13000
+
+#define ADC_TRIGGER_NOW     0
+#define ADC_TRIGGER_RISING  1
+#define ADC_TRIGGER_FALLING 2
+#define ADC_TRIGGER_ABOVE   3
+#define ADC_TRIGGER_BELOW   4
+
+struct adc_capture {
+        __u8  trigger;      /* ADC_TRIGGER_* */
+        __u8  level;        /* threshold, 8 bits like the samples */
+        __u16 pre;          /* samples to keep from before the trigger */
+};
+
+#define ADC_IOC_CAPTURE _IOW(ADC_IOC_MAGIC, 46, struct adc_capture)
+
+/* a block of samples in one call: the teensy takes .count samples of
+ * the unit, one every .period_us, rounded up to a multiple of
+ * ADC_STREAM_TICK_US, and sends them back a report full at a time.
+ * They land in .buf, 2 bytes each, high byte first, like a single
+ * read. A stream keeps going meanwhile; other callers wait their
+ * turn. */
+#define ADC_READ_N_MAX 4096
+
+struct adc_read_n {
+        __u32 count;        /* samples, at most ADC_READ_N_MAX */
+        __u32 period_us;    /* time between them */
+        __u64 buf;          /* user pointer to 2 * .count bytes */
+};
+
+#define ADC_IOC_READ_N _IOW(ADC_IOC_MAGIC, 47, struct adc_read_n)
+
 int  adc_init(void);
 void adc_exit(void);
 #endif
@@ -38,6 +38,9 @@
 #include <linux/wait.h>       /* sleep */
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>   /* large proc read() */
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
 #include "teensy_mc.h"
 #include "teensy.h"
@@ -51,16 +54,42 @@ MODULE_LICENSE("GPL");
 #define DEVICE_NAME "mc"
 #define MC_NUM_DEVS 2
 
+/* the kernel control loop of a motor, see MC_IOC_LOOP. Its one
+ * request goes adc read, then motor command, and is reused every
+ * pass. */
+struct mc_loop_t {
+        struct mutex mutex;               /* serializes start and stop */
+        spinlock_t lock;                  /* protects the rest */
+        struct hrtimer timer;
+        ktime_t period;
+        struct mc_loop cfg;
+        struct file * owner;              /* file that started it, NULL if off */
+        struct teensy_request * req;      /* the loop's request */
+        bool busy;                        /* req is in flight */
+        int last;                         /* output last sent, INT_MIN if none */
+        struct mc_loop_stats stats;
+        wait_queue_head_t idle;           /* woken when busy clears */
+};
+
 static struct mc_dev_t {
         struct cdev cdev;
+        struct mc_loop_t loop;
 } mc_devs[MC_NUM_DEVS];
 
 /* to put in filp->private_data */
 /* make it a struct so i can add more fields later if needed */
 struct mc_filp_data {
         struct mc_dev_t * mc;
+        struct mutex lock;                /* protects pending */
+        struct teensy_request * pending;  /* command in flight, if any */
+        bool ready;                       /* pending has its reply */
+        wait_queue_head_t wait;           /* woken when it does */
 };
 
+/* protects ready and the pending request's context against its
+ * callback, which may outlive the file: see mc_release() */
+static DEFINE_SPINLOCK(mc_async_lock);
+
 static dev_t mc_dev_number;
 struct class * mc_class;
 
@@ -77,6 +106,489 @@ static struct mc_filp_data * _get_private_data (struct file * filp) {
         return (struct mc_filp_data *)filp->private_data;
 }
 
+/* callback for a command in flight: flag it and wake the caller, or
+ * clean up after a caller that has closed the file */
+static void mc_cmd_complete(struct teensy_request * req) {
+        struct mc_filp_data * data;
+        unsigned long flags;
+
+        spin_lock_irqsave(&mc_async_lock, flags);
+        data = req->context;
+        if (data) {
+                data->ready = true;
+                wake_up_interruptible(&data->wait);
+        }
+        spin_unlock_irqrestore(&mc_async_lock, flags);
+
+        if (!data)
+                teensy_free_request(req);
+}
+
+/* wait for the command in flight, if any, and retire it; with
+ * @nonblock, return -EAGAIN rather than wait. Call with data->lock
+ * held.
+ *
+ * @return: < 0 on failure, or if the command failed; 0 o/w
+ */
+static int mc_cmd_finish(struct mc_filp_data * data, int nonblock) {
+        struct teensy_request * req = data->pending;
+        int ret;
+
+        if (!req)
+                return 0;
+        if (!data->ready) {
+                if (nonblock)
+                        return -EAGAIN;
+                if (wait_event_interruptible(data->wait, data->ready))
+                        return -ERESTARTSYS;
+        }
+        data->pending = NULL;
+
+        if ((ret = req->status) < 0) {
+                pk("mc_cmd_finish(): command failed: %d\n", ret);
+        } else {
+                /* force string */
+                if (req->size > 0)
+                        req->buf[req->size-1] = '\0';
+                printk(KERN_DEBUG "mc_cmd_finish(): read %zu bytes [%s] from teensy\n",
+                       req->size, req->buf);
+                ret = 0;
+        }
+
+        teensy_free_request(req);
+        return ret;
+}
+
+/* send @req and check the status byte of its reply
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_send_status(struct teensy_request * req) {
+        int ret = teensy_send(req);
+
+        if (ret >= 0)
+                ret = (req->size >= 1 && req->buf[0] == 0) ? 0 : -EIO;
+        return ret;
+}
+
+/* load the points of @traj into @unit, as many to a request as fit,
+ * using @req
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+#define MC_TRAJ_POINT_SIZE (4+1+1)
+#define MC_TRAJ_CHUNK ((TEENSY_MAX_PAYLOAD - (1+1+1+1+1)) / MC_TRAJ_POINT_SIZE)
+static int mc_traj_load(struct teensy_request * req, unsigned int unit,
+                        struct mc_trajectory * traj) {
+        /* request: ['m'][unit][index]['t'][n] then for each point
+         *          [time_us, low byte first][direction][speed]
+         * reply:   [status] */
+        struct mc_point * pt;
+        unsigned int i, n;
+        char * p;
+        int ret = 0;
+
+        for (i = 0; i < traj->count && ret == 0; i += n) {
+                n = min_t(unsigned int, traj->count - i, MC_TRAJ_CHUNK);
+                req->buf[0] = 'm';
+                req->buf[1] = unit;
+                req->buf[2] = i;
+                req->buf[3] = 't';
+                req->buf[4] = n;
+                p = req->buf + 1+1+1+1+1;
+                for (pt = &traj->points[i]; pt < &traj->points[i + n]; ++pt) {
+                        *p++ = pt->time_us & 0xff;
+                        *p++ = (pt->time_us >> 8) & 0xff;
+                        *p++ = (pt->time_us >> 16) & 0xff;
+                        *p++ = pt->time_us >> 24;
+                        *p++ = pt->direction;
+                        *p++ = pt->speed;
+                }
+                req->size = p - req->buf;
+                ret = mc_send_status(req);
+        }
+        return ret;
+}
+
+/* play the first @count loaded points of @unit from now, using @req
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_traj_play(struct teensy_request * req, unsigned int unit,
+                        unsigned int count) {
+        /* request: ['m'][unit][count]['p']
+         * reply:   [status] */
+        req->buf[0] = 'm';
+        req->buf[1] = unit;
+        req->buf[2] = count;
+        req->buf[3] = 'p';
+        req->size = 1+1+1+1;
+        return mc_send_status(req);
+}
+
+/* play the first @counts[unit] loaded points of every motor, all from
+ * the same instant on the teensy's clock, using @req; a count of 0
+ * leaves that motor be
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_traj_play_all(struct teensy_request * req, unsigned int * counts) {
+        /* request: ['m'][0][count 0]['P'][count 1]
+         * reply:   [status] */
+        req->buf[0] = 'm';
+        req->buf[1] = 0;
+        req->buf[2] = counts[0];
+        req->buf[3] = 'P';
+        req->buf[4] = counts[1];
+        req->size = 1+1+1+1+1;
+        return mc_send_status(req);
+}
+
+/* upload @traj to @unit and start it. Call with data->lock held and
+ * nothing in flight.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_traj(unsigned int unit, struct mc_trajectory * traj) {
+        struct teensy_request *req;
+        struct mc_point * pt;
+        unsigned int i;
+        int ret;
+
+        if (traj->count == 0 || traj->count > MC_TRAJ_POINTS)
+                return -EINVAL;
+        for (i = 0; i < traj->count; ++i) {
+                pt = &traj->points[i];
+                if (pt->time_us > MC_TRAJ_MAX_US ||
+                    (i > 0 && pt->time_us < traj->points[i - 1].time_us) ||
+                    (pt->direction != 'f' && pt->direction != 'r' &&
+                     pt->direction != 's'))
+                        return -EINVAL;
+        }
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        ret = mc_traj_load(req, unit, traj);
+        if (ret == 0)
+                ret = mc_traj_play(req, unit, traj->count);
+
+        teensy_free_request(req);
+        return ret;
+}
+
+/* a 16 bit value at @p, low byte first */
+static char * mc_put16(char * p, u16 v) {
+        *p++ = v & 0xff;
+        *p++ = v >> 8;
+        return p;
+}
+#define MC_LE16(p) ((p)[0] | (p)[1] << 8)
+#define MC_LE32(p) (MC_LE16(p) | (u32)MC_LE16((p) + 2) << 16)
+
+/* start, steer or read the control loop on @unit, for @cmd. Call with
+ * data->lock held and nothing in flight.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_control(unsigned int unit, unsigned int cmd, unsigned long arg) {
+        /* request: ['m'][unit][channel]['c'] then setpoint, kp, ki,
+         *             kd, out_min and out_max, 16 bits each, low
+         *             byte first, to start
+         *          ['m'][unit][0]['v'][setpoint] to move the setpoint
+         *          ['m'][unit][0]['g'] for telemetry
+         * reply:   [status], then for 'g' the fields of struct
+         *          mc_pid_telemetry up to .running, low byte first */
+        struct teensy_request *req;
+        struct mc_pid pid;
+        struct mc_pid_telemetry t;
+        unsigned char * r;
+        char * p;
+        int ret;
+
+        if (cmd == MC_IOC_PID) {
+                if (copy_from_user(&pid, (void __user *)arg, sizeof(pid)))
+                        return -EFAULT;
+                if (pid.channel >= MC_PID_CHANNELS ||
+                    pid.setpoint > MC_PID_INPUT_MAX ||
+                    pid.out_min < -MC_PID_OUT_MAX ||
+                    pid.out_max > MC_PID_OUT_MAX ||
+                    pid.out_min > pid.out_max)
+                        return -EINVAL;
+        } else if (cmd == MC_IOC_SETPOINT && arg > MC_PID_INPUT_MAX) {
+                return -EINVAL;
+        }
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        req->buf[0] = 'm';
+        req->buf[1] = unit;
+        req->buf[2] = 0;
+        p = req->buf + 1+1+1+1;
+        switch (cmd) {
+        case MC_IOC_PID:
+                req->buf[2] = pid.channel;
+                req->buf[3] = 'c';
+                p = mc_put16(p, pid.setpoint);
+                p = mc_put16(p, pid.kp);
+                p = mc_put16(p, pid.ki);
+                p = mc_put16(p, pid.kd);
+                p = mc_put16(p, pid.out_min);
+                p = mc_put16(p, pid.out_max);
+                break;
+        case MC_IOC_SETPOINT:
+                req->buf[3] = 'v';
+                p = mc_put16(p, arg);
+                break;
+        default:
+                req->buf[3] = 'g';
+                break;
+        }
+        req->size = p - req->buf;
+
+        ret = mc_send_status(req);
+        if (ret == 0 && cmd == MC_IOC_TELEMETRY) {
+                if (req->size < 1+4+4+2+2+2+2+4+1) {
+                        ret = -EIO;
+                        goto out;
+                }
+                r = (unsigned char *)req->buf + 1;
+                memset(&t, 0, sizeof(t));
+                t.iterations  = MC_LE32(r);
+                t.device_time = MC_LE32(r + 4);
+                t.input       = MC_LE16(r + 8);
+                t.setpoint    = MC_LE16(r + 10);
+                t.error       = MC_LE16(r + 12);
+                t.output      = MC_LE16(r + 14);
+                t.integral    = MC_LE32(r + 16);
+                t.running     = r[20];
+                if (copy_to_user((void __user *)arg, &t, sizeof(t)))
+                        ret = -EFAULT;
+        }
+out:
+        teensy_free_request(req);
+        return ret;
+}
+
+/* the motor @dev drives */
+static unsigned int mc_unit(struct mc_dev_t * dev) {
+        return dev - mc_devs;
+}
+
+/* a pass of @dev's loop is over; @err if a request failed. Frees
+ * @req if a stop gave up on it. */
+static void mc_loop_done(struct mc_dev_t * dev, struct teensy_request * req, bool err) {
+        struct mc_loop_t * loop = &dev->loop;
+        unsigned long flags;
+
+        spin_lock_irqsave(&loop->lock, flags);
+        if (loop->req != req) {
+                spin_unlock_irqrestore(&loop->lock, flags);
+                teensy_free_request(req);
+                return;
+        }
+        loop->busy = false;
+        if (err) {
+                loop->stats.errors++;
+                loop->last = INT_MIN;   /* send the next one whatever it is */
+        }
+        spin_unlock_irqrestore(&loop->lock, flags);
+        wake_up(&loop->idle);
+}
+
+static void mc_loop_output(struct teensy_request * req) {
+        mc_loop_done(req->context, req, req->status < 0);
+}
+
+/* the transfer function, see teensy_mc.h */
+static int mc_loop_transfer(struct mc_loop * cfg, int input) {
+        int out = cfg->offset + cfg->gain * input / 256;
+
+        if (abs(out) < cfg->deadband)
+                out = 0;
+        return max_t(int, cfg->out_min, min_t(int, out, cfg->out_max));
+}
+
+/* callback for the adc read: work out the output and send it on, if
+ * it's changed */
+static void mc_loop_input(struct teensy_request * req) {
+        struct mc_dev_t * dev = req->context;
+        struct mc_loop_t * loop = &dev->loop;
+        unsigned long flags;
+        int input, out;
+        bool send;
+
+        if (req->status < 0 || req->size < 2) {
+                mc_loop_done(dev, req, true);
+                return;
+        }
+        input = (uint8_t)req->buf[0] << 8 | (uint8_t)req->buf[1];
+        out = mc_loop_transfer(&loop->cfg, input);
+
+        spin_lock_irqsave(&loop->lock, flags);
+        send = loop->req == req && loop->owner && out != loop->last;
+        if (loop->req == req) {
+                loop->stats.iterations++;
+                loop->stats.input = input;
+                loop->stats.output = out;
+                if (send)
+                        loop->last = out;
+        }
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        if (!send) {
+                mc_loop_done(dev, req, false);
+                return;
+        }
+
+        /* speed 0 rather than 's', which would lock the motor out */
+        req->buf[0] = 'm';
+        req->buf[1] = mc_unit(dev);
+        req->buf[2] = abs(out);
+        req->buf[3] = out < 0 ? 'r' : 'f';
+        req->size = 1+1+1+1;
+        if (teensy_send_async(req, mc_loop_output, dev) < 0)
+                mc_loop_done(dev, req, true);
+}
+
+/* a pass: read the adc, unless the last pass is still going */
+static enum hrtimer_restart mc_loop_tick(struct hrtimer * timer) {
+        struct mc_loop_t * loop = container_of(timer, struct mc_loop_t, timer);
+        struct mc_dev_t * dev = container_of(loop, struct mc_dev_t, loop);
+        struct teensy_request * req = NULL;
+        unsigned long flags;
+        int ret;
+
+        spin_lock_irqsave(&loop->lock, flags);
+        if (!loop->owner) {
+                spin_unlock_irqrestore(&loop->lock, flags);
+                return HRTIMER_NORESTART;
+        }
+        if (loop->busy) {
+                loop->stats.overruns++;
+        } else {
+                loop->busy = true;
+                req = loop->req;
+        }
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        if (req) {
+                req->buf[0] = 'a';
+                req->buf[1] = loop->cfg.channel;
+                req->size = 1+1;
+                if ((ret = teensy_send_async(req, mc_loop_input, dev)) < 0) {
+                        mc_loop_done(dev, req, true);
+                        /* unplugged: nothing more to do till it's stopped */
+                        if (ret == -ENODEV)
+                                return HRTIMER_NORESTART;
+                }
+        }
+
+        hrtimer_forward(timer, ktime_get(), loop->period);
+        return HRTIMER_RESTART;
+}
+
+/* stop @dev's loop, if it runs, and let its last pass finish so its
+ * command can't land after the caller's. Call with loop->mutex held. */
+static void mc_loop_stop(struct mc_dev_t * dev) {
+        struct mc_loop_t * loop = &dev->loop;
+        struct teensy_request * req;
+        unsigned long flags;
+
+        spin_lock_irqsave(&loop->lock, flags);
+        loop->owner = NULL;
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        hrtimer_cancel(&loop->timer);
+        wait_event_timeout(loop->idle, !loop->busy, HZ);
+
+        /* a reply that never came: leave the request to its callback */
+        spin_lock_irqsave(&loop->lock, flags);
+        req = loop->busy ? NULL : loop->req;
+        loop->req = NULL;
+        loop->busy = false;
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        if (req)
+                teensy_free_request(req);
+}
+
+/* start @dev's loop for @filp, as configured by user @arg. Call with
+ * loop->mutex held.
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_loop_start(struct mc_dev_t * dev, struct file * filp, unsigned long arg) {
+        struct mc_loop_t * loop = &dev->loop;
+        struct mc_loop cfg;
+        struct teensy_request * req;
+        unsigned long flags;
+
+        if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+                return -EFAULT;
+        if (cfg.period_us < MC_LOOP_MIN_US || cfg.period_us > MC_LOOP_MAX_US ||
+            cfg.channel >= MC_PID_CHANNELS || cfg.deadband < 0 ||
+            cfg.out_min < -MC_PID_OUT_MAX || cfg.out_max > MC_PID_OUT_MAX ||
+            cfg.out_min > cfg.out_max)
+                return -EINVAL;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        mc_loop_stop(dev);
+
+        spin_lock_irqsave(&loop->lock, flags);
+        loop->cfg = cfg;
+        loop->period = ktime_set(cfg.period_us / USEC_PER_SEC,
+                                 (cfg.period_us % USEC_PER_SEC) * NSEC_PER_USEC);
+        loop->req = req;
+        loop->busy = false;
+        loop->last = INT_MIN;
+        memset(&loop->stats, 0, sizeof(loop->stats));
+        loop->owner = filp;
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        hrtimer_start(&loop->timer, loop->period, HRTIMER_MODE_REL);
+        return 0;
+}
+
+/* take @dev's motor back from its loop for another command, if the
+ * loop runs
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_loop_yield(struct mc_dev_t * dev) {
+        if (!ACCESS_ONCE(dev->loop.owner))
+                return 0;
+        if (mutex_lock_interruptible(&dev->loop.mutex))
+                return -ERESTARTSYS;
+        mc_loop_stop(dev);
+        mutex_unlock(&dev->loop.mutex);
+        return 0;
+}
+
+/* copy @dev's loop counters to user @arg
+ *
+ * @return: < 0 on failure; 0 o/w
+ */
+static int mc_loop_stats(struct mc_dev_t * dev, unsigned long arg) {
+        struct mc_loop_t * loop = &dev->loop;
+        struct mc_loop_stats stats;
+        unsigned long flags;
+
+        spin_lock_irqsave(&loop->lock, flags);
+        stats = loop->stats;
+        spin_unlock_irqrestore(&loop->lock, flags);
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+                return -EFAULT;
+        return 0;
+}
+
 /*** API ***/
 
 int mc_open (struct inode *inode, struct file *filp) {
@@ -91,22 +603,50 @@ int mc_open (struct inode *inode, struct file *filp) {
         if (!data)
                 return -ENOMEM;
         data->mc = dev;
+        mutex_init(&data->lock);
+        data->pending = NULL;
+        data->ready = false;
+        init_waitqueue_head(&data->wait);
         filp->private_data = data;
 
         return 0;
 }
 
 int mc_release (struct inode * inode, struct file * filp) {
-        //struct mc_dev_t * dev = _get_private_data(filp)->mc;
+        struct mc_filp_data * data = _get_private_data(filp);
+        struct teensy_request * req;
+        unsigned long flags;
 
         pk("release(): iminor=%d, filp=%p\n", iminor(inode), filp);
 
+        /* a loop this file started stops with it */
+        mutex_lock(&data->mc->loop.mutex);
+        if (data->mc->loop.owner == filp)
+                mc_loop_stop(data->mc);
+        mutex_unlock(&data->mc->loop.mutex);
+
+        /* a command still in flight is left for its callback to free */
+        spin_lock_irqsave(&mc_async_lock, flags);
+        req = data->pending;
+        if (req && !data->ready) {
+                req->context = NULL;
+                req = NULL;
+        }
+        spin_unlock_irqrestore(&mc_async_lock, flags);
+        if (req)
+                teensy_free_request(req);
+
         kfree(filp->private_data);
         return 0;
 }
 
 /* MAYBE TODO: would be nicer to use /sys instead of ioctls? */
+/* with O_NONBLOCK, the command is sent and we return at once; it's
+ * -EAGAIN if the last command on this file hasn't been answered yet */
 int mc_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsigned long arg) {
+        struct mc_filp_data * data = _get_private_data(filp);
+        int nonblock = filp->f_flags & O_NONBLOCK;
+        struct mc_trajectory traj;
         uint8_t speed;
         char direction;
         /* send msg */
@@ -118,20 +658,43 @@ int mc_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsign
          * [direction] 		: 1 byte
          */
         int ret = 0;
-        struct teensy_request req = {
-                /* TODO: use correct adc code */
-                .buf   = kmalloc(1+1+1+1, GFP_KERNEL),
-                .size  = 1+1+1+1,
-        };
+        struct teensy_request *req;
 
         pk("mc_ioctl(): iminor=%d, filp=%p, cmd=0x%X, arg=0x%X\n",
            iminor(inode), filp, ui cmd, ui arg);
 
-        
+        /* the kernel control loop; a command that drives the motor
+         * takes it back from the loop, anything else leaves it be */
+        switch (cmd) {
+        case MC_IOC_LOOP_STATS:
+                return mc_loop_stats(data->mc, arg);
+
+        case MC_IOC_LOOP:
+        case MC_IOC_LOOP_STOP:
+                if (mutex_lock_interruptible(&data->mc->loop.mutex))
+                        return -ERESTARTSYS;
+                if (cmd == MC_IOC_LOOP)
+                        ret = mc_loop_start(data->mc, filp, arg);
+                else
+                        mc_loop_stop(data->mc);
+                mutex_unlock(&data->mc->loop.mutex);
+                return ret;
 
-        if (req.buf == NULL) {
-                pk("mc_ioctl(): no mem when allocing zero bytes\n");
-                return -ENOMEM;
+        case MC_IOC_SETPOINT:
+        case MC_IOC_TELEMETRY:
+                break;
+
+        case MC_IOC_STOP:
+        case MC_IOC_FWD:
+        case MC_IOC_REV:
+        case MC_IOC_TRAJ:
+        case MC_IOC_PID:
+                if (mc_loop_yield(data->mc))
+                        return -ERESTARTSYS;
+                break;
+
+        default:
+                return -ENOTTY;
         }
 
         /* compute msg params */
@@ -152,33 +715,220 @@ int mc_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsign
                 /* set speed */
                 break;
 
+        case MC_IOC_TRAJ:
+                if (copy_from_user(&traj, (void __user *)arg, sizeof(traj)))
+                        return -EFAULT;
+                if (mutex_lock_interruptible(&data->lock))
+                        return -ERESTARTSYS;
+                /* after the last command, which it would undo */
+                ret = mc_cmd_finish(data, 0);
+                if (ret != -ERESTARTSYS)
+                        ret = mc_traj(iminor(inode), &traj);
+                mutex_unlock(&data->lock);
+                return ret;
+
+        case MC_IOC_PID:
+        case MC_IOC_SETPOINT:
+        case MC_IOC_TELEMETRY:
+                if (mutex_lock_interruptible(&data->lock))
+                        return -ERESTARTSYS;
+                ret = mc_cmd_finish(data, 0);
+                if (ret != -ERESTARTSYS)
+                        ret = mc_control(iminor(inode), cmd, arg);
+                mutex_unlock(&data->lock);
+                return ret;
+
         default:
                 return -ENOTTY; /* this is the right error code according to ldd3 :P */
         }
 
+        if (mutex_lock_interruptible(&data->lock))
+                return -ERESTARTSYS;
+
+        /* one command in flight per file, so they go out in order;
+         * if the last one failed, it has been logged, carry on */
+        ret = mc_cmd_finish(data, nonblock);
+        if (ret == -EAGAIN || ret == -ERESTARTSYS)
+                goto unlock;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL) {
+                pk("mc_ioctl(): no request available\n");
+                ret = -ENOMEM;
+                goto unlock;
+        }
+
         /* pack msg */
-        req.buf[0] = 'm';
-        req.buf[1] = (uint8_t)iminor(inode);
-        req.buf[2] = speed;
-        req.buf[3] = direction;
-
-        /* pass request to teensy_send() */
-        /* teensy_send() returns a DIFFERENT buf in req->buf, so we must
-           free that; our mybuf was already free'd in teensy_send().
-        */
-        ret = teensy_send(&req);
-        if (ret < 0) {
-                pk("mc_ioctl(): error calling teensy_send()\n");
-                return ret;
+        req->buf[0] = 'm';
+        req->buf[1] = (uint8_t)iminor(inode);
+        req->buf[2] = speed;
+        req->buf[3] = direction;
+        req->size = 1+1+1+1;
+
+        /* pass request to teensy_send_async(); the reply comes back
+           in req->buf */
+        data->ready = false;
+        data->pending = req;
+        if ((ret = teensy_send_async(req, mc_cmd_complete, data)) < 0) {
+                pk("mc_ioctl(): error calling teensy_send_async()\n");
+                data->pending = NULL;
+                teensy_free_request(req);
+                goto unlock;
+        }
+
+        ret = nonblock ? 0 : mc_cmd_finish(data, 0);
+        if (ret == -ERESTARTSYS)
+                ret = -EINTR; /* it's gone out, don't send it again */
+unlock:
+        mutex_unlock(&data->lock);
+        return ret;
+}
+
+/* callback for a write()'s command: nobody waits for the reply */
+static void mc_write_complete(struct teensy_request * req) {
+        if (req->status < 0)
+                printk(KERN_ERR "mc: write(): command failed: %d\n", req->status);
+        teensy_free_request(req);
+}
+
+/* send the @n commands in @cmds without waiting; teensy_send_async()
+ * batches them into as few reports as it can
+ *
+ * @return: < 0 on failure; the number queued o/w
+ */
+static int mc_write_now(struct mc_cmd * cmds, unsigned int n) {
+        struct teensy_request *req;
+        unsigned int i;
+        int ret = 0;
+
+        for (i = 0; i < n; ++i) {
+                req = teensy_alloc_request(GFP_KERNEL);
+                if (req == NULL) {
+                        ret = -ENOMEM;
+                        break;
+                }
+                req->buf[0] = 'm';
+                req->buf[1] = cmds[i].unit;
+                req->buf[2] = cmds[i].speed;
+                req->buf[3] = cmds[i].direction;
+                req->size = 1+1+1+1;
+                if ((ret = teensy_send_async(req, mc_write_complete, NULL)) < 0) {
+                        teensy_free_request(req);
+                        break;
+                }
+        }
+        return i > 0 ? i : ret;
+}
+
+/* play the @n commands in @cmds off the teensy's clock: a trajectory
+ * for each motor, all loaded before one request starts them together.
+ * @cmds has been checked to fit.
+ *
+ * @return: < 0 on failure; the number queued o/w
+ */
+static int mc_write_timed(struct mc_cmd * cmds, unsigned int n) {
+        struct teensy_request *req;
+        struct mc_trajectory traj;
+        unsigned int counts[MC_NUM_DEVS];
+        unsigned int unit, i;
+        u32 t;
+        int ret = 0;
+
+        req = teensy_alloc_request(GFP_KERNEL);
+        if (req == NULL)
+                return -ENOMEM;
+
+        for (unit = 0; unit < MC_NUM_DEVS && ret == 0; ++unit) {
+                traj.count = 0;
+                for (i = 0, t = 0; i < n; ++i) {
+                        t += cmds[i].delay_us;
+                        if (cmds[i].unit != unit)
+                                continue;
+                        traj.points[traj.count].time_us = t;
+                        traj.points[traj.count].direction = cmds[i].direction;
+                        traj.points[traj.count].speed = cmds[i].speed;
+                        traj.count++;
+                }
+                counts[unit] = traj.count;
+                if (traj.count)
+                        ret = mc_traj_load(req, unit, &traj);
+        }
+
+        if (ret == 0)
+                ret = mc_traj_play_all(req, counts);
+
+        teensy_free_request(req);
+        return ret < 0 ? ret : n;
+}
+
+/* queue the mc_cmd records in @buf, see teensy_mc.h. With O_NONBLOCK,
+ * it's -EAGAIN if the last ioctl command on this file hasn't been
+ * answered yet. A timed write always blocks, O_NONBLOCK or not, while
+ * its trajectories are loaded: the teensy has to answer each load
+ * before the plays go out. */
+ssize_t mc_write (struct file * filp, const char __user * buf, size_t count, loff_t * pos) {
+        struct mc_filp_data * data = _get_private_data(filp);
+        int nonblock = filp->f_flags & O_NONBLOCK;
+        struct mc_cmd cmds[MC_WRITE_MAX];
+        unsigned int n, i, points[MC_NUM_DEVS] = { 0 };
+        bool timed;
+        u32 t = 0;
+        int ret;
+
+        if (count == 0 || count % sizeof(struct mc_cmd) ||
+            count > sizeof(cmds))
+                return -EINVAL;
+        n = count / sizeof(struct mc_cmd);
+        if (copy_from_user(cmds, buf, count))
+                return -EFAULT;
+
+        for (i = 0; i < n; ++i) {
+                if (cmds[i].unit >= MC_NUM_DEVS ||
+                    (cmds[i].direction != 'f' && cmds[i].direction != 'r' &&
+                     cmds[i].direction != 's') ||
+                    cmds[i].delay_us > MC_TRAJ_MAX_US - t)
+                        return -EINVAL;
+                t += cmds[i].delay_us;
+                points[cmds[i].unit]++;
         }
+        timed = t > 0;
+
+        for (i = 0; i < MC_NUM_DEVS; ++i)
+                if (timed && points[i] > MC_TRAJ_POINTS)
+                        return -EINVAL;
+
+        /* any command takes a motor back from its loop */
+        for (i = 0; i < MC_NUM_DEVS; ++i)
+                if (points[i] && mc_loop_yield(&mc_devs[i]))
+                        return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&data->lock))
+                return -ERESTARTSYS;
+
+        /* after the last ioctl command on this file; if it failed, it
+         * has been logged, carry on */
+        ret = mc_cmd_finish(data, nonblock);
+        if (ret == -EAGAIN || ret == -ERESTARTSYS)
+                goto unlock;
+
+        /* not -EAGAIN under O_NONBLOCK: a retry would have the same
+         * round trips to wait for */
+        ret = timed ? mc_write_timed(cmds, n) : mc_write_now(cmds, n);
+        if (ret > 0)
+                ret *= sizeof(struct mc_cmd);
+unlock:
+        mutex_unlock(&data->lock);
+        return ret;
+}
+
+/* writable when the next command won't have to wait for the last */
+unsigned int mc_poll (struct file * filp, poll_table * wait) {
+        struct mc_filp_data * data = _get_private_data(filp);
 
-        /* force string */
-        if (req.size > 0)
-                req.buf[req.size-1] = '\0';
-        printk(KERN_DEBUG "mc_ioctl(): read %zu bytes [%s] from teensy\n",
-               req.size, req.buf);
+        poll_wait(filp, &data->wait, wait);
 
-        kfree(req.buf); /* free the NEW buf */
+        if (!ACCESS_ONCE(data->pending) || data->ready)
+                return POLLOUT | POLLWRNORM;
         return 0;
 }
 
@@ -186,7 +936,9 @@ struct file_operations mc_fops = {
         .owner   = THIS_MODULE,
         .open    = mc_open,
         .release = mc_release,
+        .write   = mc_write,
         .ioctl   = mc_ioctl,
+        .poll    = mc_poll,
 };
 
 /*** setup/teardown ***/
@@ -212,6 +964,13 @@ int mc_init(void)
         for (i = 0; i < MC_NUM_DEVS; ++i) {
                 dev = &mc_devs[i];
 
+                /* control loop, off */
+                mutex_init(&dev->loop.mutex);
+                spin_lock_init(&dev->loop.lock);
+                hrtimer_init(&dev->loop.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+                dev->loop.timer.function = mc_loop_tick;
+                init_waitqueue_head(&dev->loop.idle);
+
                 /* cdev */ /* mostly copying ELDD cmos from here on ... */
                 cdev_init(&dev->cdev, &mc_fops);
                 dev->cdev.owner = THIS_MODULE;
@@ -234,6 +993,10 @@ void mc_exit(void)
         for (i = 0; i < MC_NUM_DEVS; ++i) {
                 dev = &mc_devs[i];
 
+                mutex_lock(&dev->loop.mutex);
+                mc_loop_stop(dev);
+                mutex_unlock(&dev->loop.mutex);
+
                 /* sysfs and udev */
                 device_destroy(mc_class, MKDEV(MAJOR(mc_dev_number), i));
                 /* cdev */
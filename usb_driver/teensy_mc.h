@@ -24,6 +24,7 @@
  * based on sstore.c
  */
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #ifndef __MC_H__
 #define __MC_H__
@@ -42,6 +43,124 @@
 #define MC_IOC_FWD  _IOW(MC_IOC_MAGIC, 43, int) /* forward, at given speed */
 #define MC_IOC_REV  _IOW(MC_IOC_MAGIC, 44, int) /* reverse, at given speed */
 
+/* trajectories: MC_IOC_TRAJ uploads .count points and the teensy
+ * plays them off its own clock, each .time_us after the upload, with
+ * no more traffic. .direction is 'f', 'r' or 's'; a stop locks the
+ * motor out for 500ms like MC_IOC_STOP, and a start in that time waits
+ * for it. Times must not go down. Any other ioctl on the motor ends
+ * the trajectory. */
+#define MC_TRAJ_POINTS 16
+#define MC_TRAJ_MAX_US 1000000000
+
+struct mc_point {
+        __u32 time_us;      /* since the start */
+        __u8  direction;    /* 'f', 'r' or 's' */
+        __u8  speed;
+        __u16 reserved;
+};
+
+struct mc_trajectory {
+        __u32 count;
+        struct mc_point points[MC_TRAJ_POINTS];
+};
+
+#define MC_IOC_TRAJ _IOW(MC_IOC_MAGIC, 45, struct mc_trajectory)
+
+/* closed loop control: MC_IOC_PID starts a PID loop on the teensy that
+ * reads adc unit .channel and drives the motor towards .setpoint,
+ * MC_PID_HZ times a second, with no traffic at all. The gains are in
+ * 1/256ths, per pass, on adc counts; the output is a speed as for
+ * MC_IOC_FWD, negative for reverse, kept in .out_min to .out_max. The
+ * loop never stops the motor with a lockout, it runs it at speed 0.
+ * MC_IOC_SETPOINT moves the setpoint of a running loop, and
+ * MC_IOC_TELEMETRY reads the state of the last pass. MC_IOC_STOP,
+ * MC_IOC_FWD, MC_IOC_REV or MC_IOC_TRAJ end the loop. */
+#define MC_PID_HZ 1000
+#define MC_PID_CHANNELS 12     /* same as ADC_NUM_CHANNELS */
+#define MC_PID_INPUT_MAX 0x3ff /* 10 bit adc */
+#define MC_PID_OUT_MAX 255
+
+struct mc_pid {
+        __u8  channel;
+        __u8  reserved;
+        __u16 setpoint;
+        __s16 kp, ki, kd;
+        __s16 out_min, out_max;
+};
+
+struct mc_pid_telemetry {
+        __u32 iterations;   /* passes since MC_IOC_PID */
+        __u32 device_time;  /* the input was taken at, in 500ns ticks */
+        __u16 input;
+        __u16 setpoint;
+        __s16 error;        /* setpoint - input */
+        __s16 output;
+        __s32 integral;
+        __u8  running;
+        __u8  reserved[3];
+};
+
+#define MC_IOC_PID       _IOW(MC_IOC_MAGIC, 46, struct mc_pid)
+#define MC_IOC_SETPOINT  _IOW(MC_IOC_MAGIC, 47, int)
+#define MC_IOC_TELEMETRY _IOR(MC_IOC_MAGIC, 48, struct mc_pid_telemetry)
+
+/* a control loop in the kernel, for logic that has to stay on the
+ * host: MC_IOC_LOOP reads adc unit .channel every .period_us and sets
+ * the motor to
+ *
+ *   output = .offset + .gain * input / 256
+ *
+ * made 0 when |output| < .deadband, then kept in .out_min to .out_max;
+ * negative is reverse, as for MC_IOC_PID. A pass that finds the last
+ * one still waiting for the teensy is skipped and counted as an
+ * overrun. The motor is only sent a change. The loop runs until
+ * MC_IOC_LOOP_STOP, any other command on the motor, or the file is
+ * closed; MC_IOC_LOOP_STATS reads its counters. */
+#define MC_LOOP_MIN_US 1000
+#define MC_LOOP_MAX_US 1000000
+
+struct mc_loop {
+        __u32 period_us;
+        __u8  channel;      /* adc unit */
+        __u8  reserved;
+        __s16 gain;         /* 1/256ths */
+        __s16 offset;
+        __s16 deadband;
+        __s16 out_min, out_max;
+};
+
+struct mc_loop_stats {
+        __u32 iterations;   /* passes that read the adc */
+        __u32 overruns;     /* passes skipped */
+        __u32 errors;       /* requests that failed */
+        __u16 input;        /* of the last pass */
+        __s16 output;
+};
+
+#define MC_IOC_LOOP       _IOW(MC_IOC_MAGIC, 49, struct mc_loop)
+#define MC_IOC_LOOP_STOP  _IO(MC_IOC_MAGIC, 50)
+#define MC_IOC_LOOP_STATS _IOR(MC_IOC_MAGIC, 51, struct mc_loop_stats)
+
+/* write() takes up to MC_WRITE_MAX of these, for either motor, and
+ * returns once they're queued; they go out batched, as many to a
+ * report as fit, and nobody waits for the replies. If any has a
+ * .delay_us, the write is timed instead: each command runs .delay_us
+ * after the one before it, the first after the write, played off the
+ * teensy's clock as a trajectory per motor (see MC_IOC_TRAJ), both
+ * started at the same instant, so at most MC_TRAJ_POINTS a motor and
+ * MC_TRAJ_MAX_US in all. A timed write blocks until the trajectories
+ * are loaded and started, even with O_NONBLOCK, and poll() doesn't
+ * account for that. */
+#define MC_WRITE_MAX 32
+
+struct mc_cmd {
+        __u8  unit;         /* motor */
+        __u8  direction;    /* 'f', 'r' or 's' */
+        __u8  speed;
+        __u8  reserved;
+        __u32 delay_us;
+};
+
 int  mc_init(void);
 void mc_exit(void);
 #endif